@@ -0,0 +1,95 @@
+/*
+ * bench_broadcast.c
+ * Fan-out cost of room_broadcast() for rooms from a couple of members up
+ * to 100000, spread over WORKERS workers: walked inline, as rooms are
+ * until they pass FANOUT_MIN, and fanned out to the owning workers,
+ * whose share this thread then delivers as worker_fanout() does.
+ */
+#define main sup_main
+#include "sup.c"
+#undef main
+
+#include <time.h>
+
+#define WORKERS 8
+#define PEERS (1 << 21)         /* deliveries timed per room size and path */
+
+static double now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Time rounds broadcasts to r, fanned out or not, in ns per member */
+static double time_rounds(Room *r, int n, int rounds, int fanout, Msg *m) {
+        double t0;
+        int i, j;
+
+        r->fanout = fanout;
+        t0 = now();
+        for (i = 0; i < rounds; i++) {
+                room_broadcast(r, m, NULL);
+                for (j = 0; fanout && j < WORKERS; j++)
+                        worker_fanout(&workers[j]);
+        }
+        return (now() - t0) * 1e9 / ((double)rounds * n);
+}
+
+/* Fill the lobby with n clients, round-robin over the workers, and time it */
+static void bench(int n) {
+        char buf[] = "the quick brown fox jumps over the lazy dog\n";
+        int i, rounds = PEERS / n;
+        double inline_ns, fanout_ns;
+        Node *p;
+        Msg *m;
+
+        for (i = 0; i < n; i++)
+                list_append(i, &workers[i % WORKERS]);
+        m = msg_new(buf, sizeof(buf));
+        /* Prime every queue so later rounds hit the same overflow path */
+        room_broadcast(lobby, m, NULL);
+
+        inline_ns = time_rounds(lobby, n, rounds, 0, m);
+        fanout_ns = time_rounds(lobby, n, rounds, 1, m);
+        lobby->fanout = 0;
+        printf("%8d members  inline %6.1f ns/peer  fanout %6.1f ns/peer\n",
+               n, inline_ns, fanout_ns);
+
+        msg_put(m);
+        for (i = 0; i < n; i++) {
+                p = list_lookup(i);
+                list_delete(p);
+                room_leave(p);
+                node_free(p);
+        }
+        ebr_reclaim();
+}
+
+int main(int argc, char *argv[]) {
+        int sizes[] = { 2, 16, 1000, 10000, 100000 };
+        int i;
+
+        opts.threads = WORKERS;
+        opts.out_max = 1;
+        opts.overflow = DROP_NEWEST;
+        metrics_init();
+        pool_init();
+        ebr_init();
+        list_init();
+        room_init();
+        for (i = 0; i < WORKERS; i++) {
+                workers[i].id = i;
+                if (worker_init(&workers[i]) < 0) {
+                        perror("setup");
+                        return -1;
+                }
+        }
+        if (ebr_register() < 0) {
+                perror("setup");
+                return -1;
+        }
+        for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++)
+                bench(sizes[i]);
+        return 0;
+}
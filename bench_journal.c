@@ -0,0 +1,80 @@
+/*
+ * bench_journal.c
+ * Sustained journal throughput: broadcasts queued the way room_record()
+ * queues them, timed until all of them are durable.
+ */
+#define main sup_main
+#include "sup.c"
+#undef main
+
+#define ROOMS 8
+#define TOTAL_BYTES (256 << 20)
+
+static double now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Journal TOTAL_BYTES of size byte messages spread over ROOMS rooms */
+static void bench(Room **rooms, int size) {
+        unsigned long count = TOTAL_BYTES / size, i, done, lost;
+        char buf[size];
+        double t0, t;
+        Msg *m;
+
+        memset(buf, 'x', size);
+        buf[size-1] = '\n';
+        done = __atomic_load_n(&journal.written, __ATOMIC_RELAXED);
+        lost = journal.lost;
+        t0 = now();
+        for (i = 0; i < count; i++) {
+                /* Stay under JOURNAL_MAX, or this measures dropping */
+                while (__atomic_load_n(&journal.len, __ATOMIC_RELAXED)
+                       > JOURNAL_MAX / 2)
+                        sched_yield();
+                m = msg_new(buf, size);
+                pthread_mutex_lock(&rooms[i % ROOMS]->mutex);
+                room_record(rooms[i % ROOMS], m);
+                pthread_mutex_unlock(&rooms[i % ROOMS]->mutex);
+                msg_put(m);
+        }
+        while (__atomic_load_n(&journal.written, __ATOMIC_RELAXED) - done
+               < count - (journal.lost - lost))
+                usleep(1000);
+        t = now() - t0;
+        printf("%6d bytes  %9.0f msgs/sec  %7.1f MB/sec  %lu lost\n",
+               size, count / t, count * (double)size / t / (1 << 20),
+               journal.lost - lost);
+}
+
+int main(int argc, char *argv[]) {
+        char dir[] = "/tmp/bench_journal.XXXXXX", cmd[64], name[16];
+        int sizes[] = { 64, 512, 4096 };
+        Room *rooms[ROOMS];
+        int i;
+
+        if (mkdtemp(dir) == NULL) {
+                perror("mkdtemp");
+                return -1;
+        }
+        opts.threads = 1;
+        opts.journal = dir;
+        metrics_init();
+        pool_init();
+        ebr_init();
+        if (journal_init() < 0 || journal_start() < 0) {
+                perror("journal");
+                return -1;
+        }
+        room_init();
+        for (i = 0; i < ROOMS; i++) {
+                snprintf(name, sizeof(name), "bench%d", i);
+                rooms[i] = room_get(name);
+        }
+        for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++)
+                bench(rooms, sizes[i]);
+        snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+        return system(cmd);
+}
@@ -0,0 +1,98 @@
+/*
+ * bench_lines.c
+ * Newline search throughput of the line_find() versions, against the
+ * memchr() they have to beat, over input split into lines of various
+ * lengths the way chat_lines() walks it.
+ */
+#define main sup_main
+#include "sup.c"
+#undef main
+
+#include <time.h>
+
+#define INPUT_SIZE (1 << 20)
+#define ROUNDS 200
+
+static double now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Count the lines in buf with find, the way chat_lines() splits input */
+static int lines(int (*find)(const char *, int), const char *buf, int len) {
+        int off = 0, nl, n = 0;
+
+        while ((nl = find(buf + off, len - off)) >= 0) {
+                off += nl + 1;
+                n++;
+        }
+        return n;
+}
+
+/* Time a search over buf; returns GB/s, or -1 if it miscounted */
+static double bench(int (*find)(const char *, int), const char *buf,
+                    int len, int expect) {
+        double t0;
+        int r, n = 0;
+
+        t0 = now();
+        for (r = 0; r < ROUNDS; r++)
+                n += lines(find, buf, len);
+        if (n != expect * ROUNDS)
+                return -1;
+        return (double)len * ROUNDS / (now() - t0) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+        struct {
+                const char *name;
+                int (*find)(const char *, int);
+        } finds[] = {
+                { "memchr", line_find_memchr },
+#ifdef __x86_64__
+                { "sse2", line_find_sse2 },
+                { "avx2", line_find_avx2 },
+#endif
+        };
+        int sizes[] = { 16, 80, 512, 4096 };
+        char *buf;
+        int i, j, n;
+
+        __builtin_cpu_init();
+        buf = malloc(INPUT_SIZE);
+        if (buf == NULL) {
+                perror("malloc");
+                return -1;
+        }
+        printf("%10s", "line len");
+        for (j = 0; j < sizeof(finds)/sizeof(finds[0]); j++)
+                printf("  %7s", finds[j].name);
+        printf("   (GB/s)\n");
+        for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+                /* Lines scattered around the nominal length */
+                for (j = 0, n = 0; j < INPUT_SIZE; j++) {
+                        buf[j] = 'a' + j % 26;
+                        if (rand() % sizes[i] == 0) {
+                                buf[j] = '\n';
+                                n++;
+                        }
+                }
+                printf("%10d", sizes[i]);
+                for (j = 0; j < sizeof(finds)/sizeof(finds[0]); j++) {
+#ifdef __x86_64__
+                        if (finds[j].find == line_find_avx2
+                            && !__builtin_cpu_supports("avx2")) {
+                                printf("  %7s", "-");
+                                continue;
+                        }
+#endif
+                        printf("  %7.2f", bench(finds[j].find, buf,
+                                                INPUT_SIZE, n));
+                }
+                printf("\n");
+        }
+        free(buf);
+        return 0;
+}
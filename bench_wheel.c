@@ -0,0 +1,238 @@
+/*
+ * bench_wheel.c
+ * Cost of the timer wheel: arming and cancelling client timers, and
+ * running the wheel over a span reaching its top level, checking every timer
+ * comes out on its own tick after cascading down. Then node_timeout() is
+ * driven on a made-up clock through an idle client's ping and close and
+ * a stalled writer's close.
+ */
+#define main sup_main
+#include "sup.c"
+#undef main
+
+#include <time.h>
+
+#define TIMERS (1 << 20)
+#define SPAN (1UL << 19)        /* ticks the timers are spread over */
+#define SEC 1000000000UL
+
+static double now(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Arm and cancel every timer, in ns per pair */
+static double time_cancel(Wheel *wh, Timer *t, unsigned long *due) {
+        double t0;
+        int i;
+
+        t0 = now();
+        for (i = 0; i < TIMERS; i++)
+                wheel_add(wh, &t[i], due[i]);
+        for (i = 0; i < TIMERS; i++)
+                wheel_del(wh, &t[i]);
+        if (wh->count)
+                return -1;
+        return (now() - t0) * 1e9 / TIMERS;
+}
+
+/*
+ * Arm every timer, cancel every other one, and run the wheel to the end
+ * of the span a tick at a time. The ones left have to come out on their
+ * own tick, whatever level they started on. Returns ns per tick, or -1 if
+ * a timer came out early, late, twice or after it was cancelled.
+ */
+static double time_advance(Wheel *wh, Timer *t, unsigned long *due) {
+        unsigned long tick, end = wh->now + SPAN, out = 0;
+        Timer *e, *expired;
+        double t0;
+        int i;
+
+        for (i = 0; i < TIMERS; i++)
+                wheel_add(wh, &t[i], due[i]);
+        for (i = 1; i < TIMERS; i += 2)
+                wheel_del(wh, &t[i]);
+        t0 = now();
+        for (tick = wh->now + 1; tick <= end; tick++) {
+                expired = NULL;
+                wheel_advance(wh, tick, &expired);
+                for (e = expired; e != NULL; e = e->next, out++)
+                        if (e->expires != tick || (e - t) % 2
+                            || e->pprev != NULL)
+                                return -1;
+        }
+        t0 = now() - t0;
+        if (out != TIMERS / 2 || wh->count)
+                return -1;
+        return t0 * 1e9 / SPAN;
+}
+
+/*
+ * A timer past the top level waits in its last slot and comes out when
+ * the wheel gets there, early, for its owner to set again
+ */
+static int check_far(Wheel *wh) {
+        unsigned long top = 1UL << (WHEEL_BITS * WHEEL_LEVELS);
+        Timer t, *expired = NULL;
+
+        wheel_add(wh, &t, wh->now + top + 5);
+        wheel_advance(wh, wh->now + top - 2, &expired);
+        if (expired != NULL)
+                return -1;
+        wheel_advance(wh, wh->now + 1, &expired);
+        return expired == &t && t.next == NULL && !wh->count ? 0 : -1;
+}
+
+/* The text of a client's newest queued message, or "" */
+static const char *last_out(Node *p) {
+        static char text[64];
+        Msg *m;
+
+        if (!out_size(p))
+                return "";
+        m = p->out[(p->out_write + p->out_cap - 1) % p->out_cap];
+        snprintf(text, sizeof(text), "%.*s", (int)m->len, m->data);
+        return text;
+}
+
+/*
+ * An idle client is pinged after opts.idle and its timer set for another
+ * opts.idle, an answer puts it back to waiting, and one that stays silent
+ * after a ping is closed
+ */
+static int check_idle(Node *p) {
+        unsigned long t = now_ns(), idle;
+
+        opts.idle = 30;
+        opts.stall = 0;
+        idle = opts.idle * SEC;
+        p->heard = t;
+        node_timeout(p, t);
+        if (p->timer.pprev == NULL || out_size(p) || p->ping_at)
+                return -1;
+        node_timeout(p, t + idle - 1);
+        if (out_size(p) || p->ping_at)
+                return -1;
+        node_timeout(p, t + idle);
+        if (strcmp(last_out(p), "/ping\n") || p->ping_at != t + idle)
+                return -1;
+        /* Answered: back to counting from what it sent */
+        p->heard = t + idle + SEC;
+        node_timeout(p, t + idle + 2 * SEC);
+        if (p->ping_at || out_size(p) != 1 || p->closing)
+                return -1;
+        node_timeout(p, p->heard + idle);
+        if (out_size(p) != 2 || p->ping_at != p->heard + idle)
+                return -1;
+        node_timeout(p, p->ping_at + idle - 1);
+        if (p->closing || p->timer.pprev == NULL)
+                return -1;
+        node_timeout(p, p->ping_at + idle);
+        return p->closing ? 0 : -1;
+}
+
+/*
+ * A client with output queued that does not move for opts.stall is
+ * closed; one whose writes go through now and then is not, and nor is one
+ * with nothing to write
+ */
+static int check_stall(Node *p) {
+        unsigned long t = now_ns(), stall;
+
+        opts.idle = 0;
+        opts.stall = 10;
+        stall = opts.stall * SEC;
+        node_timeout(p, t + 10 * stall);
+        if (p->closing || p->timer.pprev == NULL)
+                return -1;
+        chat_reply(p, "queued");
+        t = p->progress;
+        node_timeout(p, t + stall - 1);
+        if (p->closing)
+                return -1;
+        /* A write went out meanwhile */
+        p->progress = t + stall / 2;
+        node_timeout(p, t + stall);
+        if (p->closing)
+                return -1;
+        node_timeout(p, p->progress + stall);
+        return p->closing ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+        static Wheel wh;
+        unsigned long *due;
+        double cancel_ns, advance_ns;
+        Timer *t;
+        Node *p[2];
+        int i, ret = 0;
+
+        opts.threads = 1;
+        opts.proto = PROTO_LINES;
+        metrics_init();
+        pool_init();
+        ebr_init();
+        list_init();
+        room_init();
+        if (worker_init(&workers[0]) < 0 || ebr_register() < 0) {
+                perror("setup");
+                return -1;
+        }
+
+        t = calloc(TIMERS, sizeof(Timer));
+        due = malloc(TIMERS * sizeof(unsigned long));
+        if (t == NULL || due == NULL) {
+                perror("malloc");
+                return -1;
+        }
+        wh.now = 1000;
+        for (i = 0; i < TIMERS; i++)
+                due[i] = wh.now + 1 + rand() % SPAN;
+        /* Right on and either side of every level's boundary */
+        for (i = 0; i < 2 * (WHEEL_LEVELS - 1); i += 2) {
+                due[i] = wh.now + (1UL << (WHEEL_BITS * (i / 2 + 1))) - 1;
+                due[i + 2 * (WHEEL_LEVELS - 1)] = due[i] + 1;
+                due[i + 4 * (WHEEL_LEVELS - 1)] = due[i] + 2;
+        }
+        cancel_ns = time_cancel(&wh, t, due);
+        advance_ns = time_advance(&wh, t, due);
+        if (cancel_ns < 0 || advance_ns < 0) {
+                printf("timers came out on the wrong tick\n");
+                ret = 1;
+        } else {
+                printf("%8d timers  add+cancel %5.1f ns  "
+                       "advance %6.1f ns/tick\n", TIMERS, cancel_ns,
+                       advance_ns);
+        }
+        free(t);
+        free(due);
+        if (check_far(&wh) < 0) {
+                printf("timer past the top level     FAILED\n");
+                ret = 1;
+        } else {
+                printf("timer past the top level     ok\n");
+        }
+
+        for (i = 0; i < 2; i++)
+                p[i] = list_append(i, &workers[0]);
+        if (check_idle(p[0]) < 0) {
+                printf("idle ping and close          FAILED\n");
+                ret = 1;
+        } else {
+                printf("idle ping and close          ok\n");
+        }
+        if (check_stall(p[1]) < 0) {
+                printf("write stall close            FAILED\n");
+                ret = 1;
+        } else {
+                printf("write stall close            ok\n");
+        }
+        for (i = 0; i < 2; i++) {
+                list_delete(p[i]);
+                room_leave(p[i]);
+                node_free(p[i]);
+        }
+        return ret;
+}
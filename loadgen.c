@@ -0,0 +1,448 @@
+/*
+ * loadgen.c
+ * Load generator for sup: opens many connections, has some of them send
+ * timestamped messages at a fixed rate, and reports how many messages
+ * per second come back out and how long fan-out took.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define MAX_THREADS 64
+#define MAX_EVENTS 256
+#define IN_SIZE 65536
+#define OUT_SIZE 65536
+#define HDR 5                   /* framed protocol header */
+#define FRAME_CHAT 1
+#define BUCKETS (64 * 16)       /* 16 per power of two */
+
+/* Settings */
+struct {
+        int conns;
+        int threads;
+        int senders;    /* connections that send; all of them receive */
+        int rate;       /* messages per second per sender */
+        int size;       /* bytes per message, newline or header included */
+        int duration;   /* seconds measured, after the warmup */
+        int warmup;
+        int framed;
+        const char *host, *port;
+} opts = { 100, 4, 10, 100, 64, 10, 1, 0, NULL, NULL };
+
+/* One connection and what it has half read or not yet written */
+typedef struct {
+        int sock;
+        int sender;
+        unsigned long next;     /* when its next message is due */
+        char in[IN_SIZE];
+        int in_len;
+        char out[OUT_SIZE];
+        int out_len;
+} Conn;
+
+/*
+ * A histogram of latencies in nanoseconds. Values fall into 16 buckets
+ * per power of two, so every bucket is within about 6% of its values.
+ */
+typedef struct {
+        unsigned long counts[BUCKETS];
+        unsigned long total, max;
+} Hist;
+
+/* A load thread with its own share of the connections */
+typedef struct {
+        int id;
+        pthread_t th;
+        int epfd;
+        Conn **conns;
+        int nconns;
+        unsigned long sent, dropped, received, bytes;
+        Hist hist;
+} Load;
+
+Load loads[MAX_THREADS];
+unsigned long start_ns, measure_ns, end_ns;
+
+static unsigned long now_ns(void);
+static int connect_to(const char *host, const char *port);
+static void *load_run(void *arg);
+static void load_send(Load *l, Conn *c, unsigned long due);
+static int load_flush(Load *l, Conn *c);
+static int load_read(Load *l, Conn *c);
+static void load_message(Load *l, const char *data, int len);
+static void hist_add(Hist *h, unsigned long v);
+static void hist_merge(Hist *to, Hist *from);
+static unsigned long hist_quantile(Hist *h, double q);
+static int hist_bucket(unsigned long v);
+static unsigned long hist_value(int b);
+
+int main(int argc, char *argv[]) {
+        struct rlimit rl;
+        unsigned long sent = 0, dropped = 0, received = 0, bytes = 0;
+        Hist hist;
+        double secs;
+        Conn *c;
+        int i, opt;
+
+        while ((opt = getopt(argc, argv, "c:d:fl:r:s:t:w:")) != -1) {
+                switch (opt) {
+                case 'c':
+                        opts.conns = atoi(optarg);
+                        break;
+                case 'd':
+                        opts.duration = atoi(optarg);
+                        break;
+                case 'f':
+                        opts.framed = 1;
+                        break;
+                case 'l':
+                        opts.size = atoi(optarg);
+                        break;
+                case 'r':
+                        opts.rate = atoi(optarg);
+                        break;
+                case 's':
+                        opts.senders = atoi(optarg);
+                        break;
+                case 't':
+                        opts.threads = atoi(optarg);
+                        break;
+                case 'w':
+                        opts.warmup = atoi(optarg);
+                        break;
+                default:
+                        goto usage;
+                }
+        }
+        if (argc - optind != 2 || opts.conns < 2 || opts.threads < 1
+            || opts.threads > MAX_THREADS || opts.senders < 1
+            || opts.senders > opts.conns || opts.rate < 1
+            || opts.size < 32 || opts.size > OUT_SIZE / 2
+            || opts.duration < 1 || opts.warmup < 0) {
+usage:
+                printf("Usage: %s [-f] [-c conns] [-t threads] [-s senders] "
+                       "[-r msgs/sec each] [-l bytes] [-d secs] "
+                       "[-w warmup secs] <ip> <port>\n", argv[0]);
+                return -1;
+        }
+        opts.host = argv[optind];
+        opts.port = argv[optind+1];
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0
+            && rl.rlim_cur < (rlim_t)opts.conns + 64) {
+                rl.rlim_cur = rl.rlim_max;
+                setrlimit(RLIMIT_NOFILE, &rl);
+        }
+
+        /* Connect everyone up front, dealing them out to the threads */
+        for (i = 0; i < opts.threads; i++) {
+                loads[i].id = i;
+                loads[i].epfd = epoll_create1(0);
+                loads[i].conns = calloc(opts.conns / opts.threads + 1,
+                                        sizeof(Conn *));
+                if (loads[i].epfd < 0 || loads[i].conns == NULL) {
+                        perror("setup");
+                        return -1;
+                }
+        }
+        for (i = 0; i < opts.conns; i++) {
+                c = calloc(1, sizeof(Conn));
+                if (c == NULL) {
+                        perror("calloc");
+                        return -1;
+                }
+                c->sock = connect_to(opts.host, opts.port);
+                if (c->sock < 0)
+                        return -1;
+                /* Spread senders evenly over the threads too */
+                c->sender = i % (opts.conns / opts.senders) == 0
+                            && i / (opts.conns / opts.senders) < opts.senders;
+                loads[i % opts.threads].conns[i / opts.threads] = c;
+                loads[i % opts.threads].nconns++;
+        }
+        printf("%d connections, %d sending %d msgs/sec of %d bytes, "
+               "%s protocol\n", opts.conns, opts.senders, opts.rate,
+               opts.size, opts.framed ? "framed" : "lines");
+
+        /* Give the server a moment to register the last connections */
+        sleep(1);
+        start_ns = now_ns();
+        measure_ns = start_ns + opts.warmup * 1000000000UL;
+        end_ns = measure_ns + opts.duration * 1000000000UL;
+        for (i = 0; i < opts.threads; i++) {
+                if (pthread_create(&loads[i].th, NULL, load_run, &loads[i])) {
+                        perror("pthread_create");
+                        return -1;
+                }
+        }
+        memset(&hist, 0, sizeof(hist));
+        for (i = 0; i < opts.threads; i++) {
+                pthread_join(loads[i].th, NULL);
+                sent += loads[i].sent;
+                dropped += loads[i].dropped;
+                received += loads[i].received;
+                bytes += loads[i].bytes;
+                hist_merge(&hist, &loads[i].hist);
+        }
+
+        secs = opts.duration;
+        printf("sent      %lu msgs (%.0f/sec), %lu skipped on a full "
+               "socket\n", sent, sent / secs, dropped);
+        printf("delivered %lu msgs (%.0f/sec, %.1f MB/sec), "
+               "%.1f%% of expected\n", received, received / secs,
+               bytes / secs / 1e6,
+               sent ? 100.0 * received / ((double)sent * (opts.conns - 1))
+                    : 0.0);
+        printf("latency   p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  "
+               "max %.3f ms\n", hist_quantile(&hist, 0.5) / 1e6,
+               hist_quantile(&hist, 0.99) / 1e6,
+               hist_quantile(&hist, 0.999) / 1e6, hist.max / 1e6);
+        return 0;
+}
+
+/* Monotonic clock in nanoseconds */
+static unsigned long now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Open a non-blocking connection to the server */
+static int connect_to(const char *host, const char *port) {
+        struct addrinfo hints, *res;
+        int sock, err;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        err = getaddrinfo(host, port, &hints, &res);
+        if (err) {
+                fprintf(stderr, "loadgen: %s\n", gai_strerror(err));
+                return -1;
+        }
+        sock = socket(res->ai_family, SOCK_STREAM, 0);
+        if (sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen) < 0) {
+                perror("connect");
+                freeaddrinfo(res);
+                return -1;
+        }
+        freeaddrinfo(res);
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        return sock;
+}
+
+/*
+ * Send on schedule and read everything that arrives until the run is
+ * over. Senders start at staggered times so they don't all fire at once.
+ */
+static void *load_run(void *arg) {
+        Load *l = arg;
+        struct epoll_event ev, events[MAX_EVENTS];
+        unsigned long now, next, interval = 1000000000UL / opts.rate;
+        int i, n, timeout;
+        Conn *c;
+
+        for (i = 0; i < l->nconns; i++) {
+                c = l->conns[i];
+                c->next = start_ns + interval * (l->id + i * opts.threads)
+                          / opts.conns;
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->sock, &ev) < 0) {
+                        perror("epoll_ctl");
+                        return NULL;
+                }
+        }
+        while ((now = now_ns()) < end_ns) {
+                next = end_ns;
+                for (i = 0; i < l->nconns; i++) {
+                        c = l->conns[i];
+                        if (!c->sender)
+                                continue;
+                        /* Stamp the time it was due, not when it went */
+                        while (c->next <= now) {
+                                load_send(l, c, c->next);
+                                c->next += interval;
+                        }
+                        if (c->next < next)
+                                next = c->next;
+                }
+                timeout = (next - now) / 1000000;
+                n = epoll_wait(l->epfd, events, MAX_EVENTS, timeout);
+                for (i = 0; i < n; i++) {
+                        c = events[i].data.ptr;
+                        if (events[i].events & EPOLLOUT)
+                                load_flush(l, c);
+                        if (events[i].events & EPOLLIN && load_read(l, c) < 0)
+                                return NULL;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Queue one message stamped with the time it was due. A sender whose
+ * socket has backed up that far just skips it, and it is counted.
+ */
+static void load_send(Load *l, Conn *c, unsigned long due) {
+        char *p = c->out + c->out_len;
+        uint32_t n;
+        int len, body;
+
+        if (due < measure_ns)
+                due |= 1UL << 63;       /* warmup: delivered, not measured */
+        if (c->out_len + opts.size > OUT_SIZE) {
+                if (!(due >> 63))
+                        l->dropped++;
+                return;
+        }
+        body = opts.framed ? opts.size - HDR : opts.size - 1;
+        if (opts.framed) {
+                n = htonl(body);
+                memcpy(p, &n, 4);
+                p[4] = FRAME_CHAT;
+                p += HDR;
+        }
+        len = snprintf(p, body + 1, "%lu ", due);
+        memset(p + len, 'x', body - len);
+        if (!opts.framed)
+                p[body] = '\n';
+        c->out_len += opts.size;
+        if (!(due >> 63))
+                l->sent++;
+        load_flush(l, c);
+}
+
+/* Write what is queued, watching for writability if it doesn't all go */
+static int load_flush(Load *l, Conn *c) {
+        struct epoll_event ev;
+        int n;
+
+        n = write(c->sock, c->out, c->out_len);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("write");
+                return -1;
+        }
+        if (n > 0) {
+                memmove(c->out, c->out + n, c->out_len - n);
+                c->out_len -= n;
+        }
+        ev.events = EPOLLIN | (c->out_len ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->sock, &ev);
+        return 0;
+}
+
+/* Read what arrived and take it apart into messages */
+static int load_read(Load *l, Conn *c) {
+        uint32_t len;
+        char *nl;
+        int n, off;
+
+        n = read(c->sock, c->in + c->in_len, IN_SIZE - c->in_len);
+        if (n < 0)
+                return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        if (n == 0) {
+                fprintf(stderr, "loadgen: server closed a connection\n");
+                return -1;
+        }
+        c->in_len += n;
+        for (off = 0; off < c->in_len; ) {
+                if (opts.framed) {
+                        if (c->in_len - off < HDR)
+                                break;
+                        memcpy(&len, c->in + off, 4);
+                        len = ntohl(len);
+                        if (c->in_len - off < HDR + len)
+                                break;
+                        if (c->in[off+4] == FRAME_CHAT)
+                                load_message(l, c->in + off + HDR, len);
+                        off += HDR + len;
+                } else {
+                        nl = memchr(c->in + off, '\n', c->in_len - off);
+                        if (nl == NULL)
+                                break;
+                        load_message(l, c->in + off, nl - (c->in + off));
+                        off = nl - c->in + 1;
+                }
+        }
+        memmove(c->in, c->in + off, c->in_len - off);
+        c->in_len -= off;
+        return 0;
+}
+
+/* Count a delivered message and how long it took since it was due */
+static void load_message(Load *l, const char *data, int len) {
+        unsigned long due, now = now_ns();
+
+        due = strtoul(data, NULL, 10);
+        if (due >> 63 || now >= end_ns)
+                return;
+        l->received++;
+        l->bytes += len;
+        hist_add(&l->hist, now > due ? now - due : 0);
+}
+
+/* Record one value */
+static void hist_add(Hist *h, unsigned long v) {
+        h->counts[hist_bucket(v)]++;
+        h->total++;
+        if (v > h->max)
+                h->max = v;
+}
+
+/* Fold one histogram into another */
+static void hist_merge(Hist *to, Hist *from) {
+        int i;
+
+        for (i = 0; i < BUCKETS; i++)
+                to->counts[i] += from->counts[i];
+        to->total += from->total;
+        if (from->max > to->max)
+                to->max = from->max;
+}
+
+/* Return the value below which a fraction q of the values fall */
+static unsigned long hist_quantile(Hist *h, double q) {
+        unsigned long seen = 0, want = q * h->total;
+        int i;
+
+        for (i = 0; i < BUCKETS; i++) {
+                seen += h->counts[i];
+                if (seen > want)
+                        return hist_value(i);
+        }
+        return h->max;
+}
+
+/* Power-of-two band, then which sixteenth of it */
+static int hist_bucket(unsigned long v) {
+        int bits;
+
+        if (v < 16)
+                return v;
+        bits = 63 - __builtin_clzl(v);
+        return (bits - 3) * 16 + ((v >> (bits - 4)) & 15);
+}
+
+/* The top of a bucket's range */
+static unsigned long hist_value(int b) {
+        int bits = b / 16 + 3;
+
+        if (b < 16)
+                return b;
+        return ((16UL + b % 16 + 1) << (bits - 4)) - 1;
+}
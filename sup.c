@@ -1,10 +1,12 @@
 /*
  * sup.c
  * Multi-threaded chat server
- * Author: Eugene Ma 
+ * Author: Eugene Ma
  * http://github.com/edma2
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -13,265 +15,7109 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <zlib.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
-#define NUM_THREADS 4
-#define QUEUE_MAX 16
+#define THREADS_MAX 256         /* workers at most; opts.threads are run */
+#define QUEUE_MAX 1024          /* default inbox length */
+#define MAX_EVENTS 64
+#define OUT_MAX 256
+#define OUT_MIN 8
+#define EBR_SLOTS (THREADS_MAX + 16)
+#define PART_WORDS ((THREADS_MAX + 63) / 64)    /* of a room's busy bitmap */
+#define TABLE_MIN 1024
+#define FLUSH_IOV 64
+#define READ_SIZE 1024          /* default bytes per read */
+#define READ_MAX 65536
+#define RING_ENTRIES 1024
+#define RBUF_COUNT 256
+#define BACKLOG 5
+#define READ_BUDGET 16
+#define TASK_BUDGET 256
+#define STEAL_MIN 2
+#define ROOM_SHARDS 64
+#define ROOM_NAME_MAX 32
+#define ROOM_MIN 16
+#define FANOUT_MIN 256
+#define FRAME_HDR 5
+#define FRAME_MAX 65536
+#undef LINE_MAX         /* limits.h, via zlib.h, has a smaller one */
+#define LINE_MAX 65536
+#define LINE_PROBE (32 << 10)   /* bytes of each line length timed */
+#define PROBE_ROUNDS 32
+#define POOL_CLASSES 11         /* 64 bytes up to 64k */
+#define SLAB_SIZE 65536
+#define NODES_MAX 16            /* NUMA nodes with pools of their own */
+#define CACHE_MAX 64
+#define CACHE_BATCH 32
+#define HIST_SHIFT 4            /* histogram buckets per power of 2, log2 */
+#define HIST_SUB (1 << HIST_SHIFT)
+#define HIST_BUCKETS ((64 - HIST_SHIFT + 1) * HIST_SUB)
+#define ADMIN_REQUEST_MAX 4096
+#define LOG_LINE 256            /* longest line logged, newline included */
+#define LOG_RING 1024           /* lines a thread may have waiting */
+#define LOG_RATE 1000           /* lines per thread per second */
+#define LOG_DRAIN_MS 10
+#define JOURNAL_SEGMENT (4 << 20)       /* bytes of messages per file */
+#define JOURNAL_MAX 65536       /* broadcasts waiting before some are lost */
+#define JOURNAL_REPLAY 16       /* newest segments a catch-up reads */
+#define RELAY_BATCH (256 << 10) /* bytes of records compressed together */
+#define RELAY_BUF_MAX (16 << 20)        /* bytes behind before dropping */
+#define RELAY_RETRY 1           /* seconds between attempts to link up */
+#define PEERS_MAX 16
+#define RATE_BURST 1            /* seconds of its rate sent at once */
+#define PARK_MS 10              /* how often throttled clients are looked at */
+#define HANDOFF_MAGIC 0x73757002
+#define HANDOFF_BATCH 64        /* clients per descriptor-passing message */
+#define HANDOFF_ADMIN THREADS_MAX       /* listener slots after the workers' */
+#define HANDOFF_CLUSTER (THREADS_MAX+1)
+#define HANDOFF_SLOTS (THREADS_MAX+2)
+#define CONFIG_LINE 256
+#define TLS_TIMEOUT 10          /* seconds a handshake may take */
+#define WHEEL_TICK_MS 100
+#define WHEEL_BITS 6            /* slots per level, log2 */
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4          /* 64 ticks, then 64 of those, and so on */
 
-/* Waiting client sockets */
+/* What to do with a message for a client whose send queue is full */
+enum { DROP_OLDEST, DROP_NEWEST, DISCONNECT };
+
+/* How workers wait for and perform socket I/O */
+enum { ENGINE_EPOLL, ENGINE_URING };
+
+/*
+ * What clients speak. Raw passes on whatever each read returns, for
+ * telnet. Lines splits input on newlines, however it was read, and sends
+ * each line on with a plain "\n". Framed wraps every message both ways
+ * in a FRAME_HDR header: a 32-bit big-endian payload length, at most
+ * FRAME_MAX, and a type byte.
+ */
+enum { PROTO_RAW, PROTO_LINES, PROTO_FRAMED };
+
+/*
+ * Frame types; clients send chat, join, leave and pong, the server chat,
+ * notices and pings
+ */
+enum { FRAME_CHAT = 1, FRAME_JOIN, FRAME_LEAVE, FRAME_NOTICE, FRAME_PING,
+       FRAME_PONG };
+
+/* How much to log; each level includes the ones before it */
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+
+/*
+ * Socket options for clients. Those set on the client listeners carry
+ * over to every socket accepted from them; the rest are set on each one
+ * as it is taken on. Zero leaves an option as the kernel has it.
+ */
+typedef struct {
+        int nodelay;            /* TCP_NODELAY: no waiting to fill segments */
+        int cork;               /* TCP_CORK around flushes of a backlog */
+        int sndbuf, rcvbuf;     /* SO_SNDBUF and SO_RCVBUF, on the listener */
+        int notsent_lowat;      /* TCP_NOTSENT_LOWAT: unsent bytes in kernel */
+        int busy_poll;          /* SO_BUSY_POLL microseconds, on the listener */
+        int defer_accept;       /* TCP_DEFER_ACCEPT seconds, on the listener */
+} Tuning;
+
+/* Runtime settings */
 struct {
-        pthread_cond_t empty;
-        pthread_mutex_t mutex;
-        int sockets[QUEUE_MAX];
-        int read, write;
+        int out_max;    /* messages queued per client before overflow */
+        int overflow;   /* overflow policy */
+        int engine;
+        int backlog;    /* kernel listen queue length */
+        int reuseport;  /* every worker accepts on its own listener */
+        int stats;      /* seconds between utilization reports, 0 for none */
+        int proto;
+        unsigned long mem_max;  /* bytes of slabs allowed, 0 for no limit */
+        int compact;    /* give buffers back as soon as they drain */
+        const char *admin;      /* port serving metrics, or NULL */
+        int log_level;
+        int log_async;  /* hand lines to a thread that writes them out */
+        int history;    /* messages a room keeps to replay on join */
+        const char *journal;    /* directory keeping every broadcast, or NULL */
+        unsigned long msg_rate; /* messages per second per client, 0 for any */
+        unsigned long byte_rate;        /* bytes per second per client, or 0 */
+        int flood_kick;         /* close over-rate clients, not pause them */
+        const char *upgrade;    /* Unix socket for hot restarts, or NULL */
+        int threads;            /* workers, 0 for one per usable CPU */
+        unsigned inbox;         /* sockets a worker holds, a power of 2 */
+        int read_size;          /* bytes taken from a socket at a time */
+        const char *config;     /* file re-read on SIGHUP, or NULL */
+        int pin;        /* pin workers, steer clients to their packets' CPU */
+        Tuning tune;
+        const char *tls_cert;   /* PEM chain to serve TLS with, or NULL */
+        const char *tls_key;    /* its private key, if not in the same file */
+        int idle;       /* seconds of silence before a ping, 0 for never */
+        int stall;      /* seconds output may sit unsent, 0 for forever */
+} opts = { OUT_MAX, DROP_OLDEST, ENGINE_EPOLL, BACKLOG, 0, 0, PROTO_RAW, 0, 0,
+           NULL, LOG_INFO, 0, 0, NULL, 0, 0, 0, NULL, 0, QUEUE_MAX, READ_SIZE,
+           NULL, 0, { 0 }, NULL, NULL, 0, 0 };
+
+/* Index of the first newline in a buffer, or -1; picked by line_init() */
+int (*line_find)(const char *buf, int len);
+
+/*
+ * Accepted sockets waiting for a worker: a ring per worker, written only
+ * by the accept loop and read only by its worker, so neither side locks.
+ */
+typedef struct {
+        int *sockets;           /* opts.inbox of each */
+        unsigned long *stamps;  /* when each was queued */
+        unsigned read, write;   /* free-running; opts.inbox is a power of 2 */
+} Inbox;
+
+/* Round-robin handoff state of the accept loop */
+struct {
+        int next;               /* worker to try first */
+        int spacefd;            /* eventfd kicked when a full inbox drains */
+        int waiting;            /* accept loop is blocked on spacefd */
 } queue;
 
-/* Active client sockets */
-typedef struct Node Node;
-struct {
-        Node *head;
-        pthread_mutex_t mutex;
-} list;
+typedef struct Node Node;
+
+/* A worker's io_uring instance and its provided receive buffers */
+typedef struct {
+        int fd;
+        unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+        unsigned local_tail;    /* submission tail not yet published */
+        struct io_uring_sqe *sqes;
+        unsigned *cq_head, *cq_tail, cq_mask;
+        struct io_uring_cqe *cqes;
+        struct io_uring_buf_ring *br;
+        unsigned short br_tail;
+        char *bufs;             /* RBUF_COUNT buffers of opts.read_size bytes */
+        struct __kernel_timespec park;  /* PARK_MS or a wheel tick */
+} Ring;
+
+/*
+ * Clients with work to do. The owner queues its ready clients here and
+ * runs them; idle workers take from the front to share the load.
+ */
+typedef struct {
+        pthread_mutex_t mutex;
+        Node **tasks;
+        unsigned head, tail;    /* free-running */
+        unsigned cap;           /* power of 2, grows as needed */
+} RunQueue;
+
+/* What a queued client is ready for */
+#define EV_READ 1
+#define EV_WRITE 2
+
+/* A broadcast handed to a worker to deliver to its share of a room */
+typedef struct Fanout Fanout;
+struct Fanout {
+        Fanout *next;
+        struct Room *room;      /* held until delivered */
+        struct Msg *m;          /* one reference */
+        Node *except;           /* only compared, never followed */
+        unsigned long seq;      /* m's place in the room's history */
+};
+
+/* A client's place in its worker's timer wheel */
+typedef struct Timer Timer;
+struct Timer {
+        Timer *next, **pprev;   /* pprev is NULL when not in the wheel */
+        unsigned long expires;  /* in ticks */
+};
+
+/*
+ * Timers hashed by expiry into WHEEL_LEVELS levels of WHEEL_SLOTS slots,
+ * each level's slots WHEEL_SLOTS times as long as the one below. Arming
+ * and cancelling only link and unlink; a tick takes the slot of timers
+ * due now, and whenever a level wraps, the next slot up is spread over
+ * the levels below it. Nothing is looked at before it is nearly due.
+ */
+typedef struct {
+        Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+        unsigned long now;      /* last tick run */
+        int count;              /* timers armed */
+} Wheel;
+
+/* Reactor threads, each multiplexing its own share of the clients */
+typedef struct {
+        int id;
+        int cpu;        /* where worker_pin() puts it */
+        int node;       /* that CPU's NUMA node */
+        int listener;   /* own SO_REUSEPORT socket, or shared, or -1 */
+        int epfd;       /* epoll instance watching this worker's clients */
+        int wakefd;     /* eventfd kicked for new sockets or pending output */
+        pthread_mutex_t mutex;
+        Node *pending;  /* clients with freshly queued output */
+        Node *parked;   /* clients over their rate, not read for now */
+        Node *fetched;  /* clients the journal has caught up */
+        Wheel wheel;    /* clients' timeouts, guarded by mutex */
+        Fanout *fanout, **fanout_tail;  /* broadcasts to deliver, FIFO */
+        struct Tls *tls;        /* sessions the TLS thread has handed over */
+        Ring ring;      /* io_uring engine only */
+        Inbox inbox;    /* sockets handed over by the accept loop */
+        RunQueue runq;
+        int idle;       /* blocked waiting for events */
+        int timer;      /* io_uring engine: a timeout is armed */
+        /* Utilization, written by the worker alone */
+        unsigned long busy_ns, idle_ns, tasks, stolen;
+        /* Memory held for this worker's clients, updated atomically */
+        long clients, client_bytes;
+} Worker;
+Worker workers[THREADS_MAX];
+
+/*
+ * The CPUs we may run on, in the order workers are placed on them: a
+ * NUMA node at a time, round and round, so however many workers there
+ * are they spread evenly over the nodes. Without NUMA every CPU is on
+ * node 0.
+ */
+struct {
+        int ncpus, nnodes;
+        int order[CPU_SETSIZE];
+        int node[CPU_SETSIZE];  /* by CPU number */
+} topo;
+
+/*
+ * Active clients indexed by socket descriptor. Broadcasts go through
+ * rooms; this is for finding a client by its socket, and for handing
+ * every client over on a hot restart.
+ */
+typedef struct {
+        int cap;
+        Node **node;            /* the client on each slot, or NULL */
+} Table;
+
+/* A room's subscribers; slots may be NULL where someone left */
+typedef struct {
+        int cap;
+        Node *slots[];
+} Members;
+
+/* The members of a room owned by one worker */
+typedef struct {
+        Members *members;       /* NULL until one of them first joins */
+        int len;                /* one past the highest slot in use */
+        int count;              /* slots actually holding a member */
+        int *free;              /* stack of empty slots below len */
+        int nfree;
+} Part;
+
+/*
+ * Where a journaled room's numbering has got to: what its next message
+ * is numbered. Read from the files once at startup and kept in the
+ * room's shard, under its lock, for as long as the room has numbers.
+ */
+typedef struct JRoom JRoom;
+struct JRoom {
+        JRoom *next;
+        unsigned long seq;
+        char name[ROOM_NAME_MAX+1];
+};
+
+/*
+ * A named conversation, its members split by owning worker. Broadcasts
+ * read the current member arrays without locking; joins and leaves fill
+ * and clear slots under the room's own mutex, copying an array only to
+ * grow or compact it. A part gets its array when the first member from
+ * its worker joins, and the busy bitmap marks the parts with members, so
+ * a broadcast only visits those. Once a room has been big it fans out:
+ * a broadcast is posted to every worker with members there, and each
+ * delivers to its own part.
+ *
+ * With opts.history set, a room also keeps its last messages in a ring
+ * indexed by sequence number, and a client joining is sent them first.
+ * A joiner notes the sequence number current when it was replayed to;
+ * delivery skips it for anything older, which it has already had.
+ */
+typedef struct Room Room;
+struct Room {
+        Room *next;             /* hash chain within the shard */
+        int id;
+        int users;              /* members plus pins; zeroed under shard */
+        int fanout;             /* set for good once count passes FANOUT_MIN */
+        pthread_mutex_t mutex;  /* guards everything below */
+        int count;
+        struct Msg **history;   /* opts.history slots; message n at n % */
+        unsigned long base;     /* seq when the room was made */
+        unsigned long seq;      /* messages broadcast so far */
+        JRoom *jroom;           /* its numbering, with opts.journal */
+        char name[ROOM_NAME_MAX+1];
+        unsigned long busy[PART_WORDS]; /* a bit per part with members */
+        Part part[];            /* one per worker */
+};
+
+/* Rooms hashed by name; a shard's lock only covers finding and freeing */
+struct {
+        pthread_mutex_t mutex;
+        Room *rooms;
+        JRoom *numbered;        /* rooms with journaled messages */
+} shards[ROOM_SHARDS];
+
+/* Where clients start out, and go back to on /leave */
+Room *lobby;
+int room_ids;
+
+/*
+ * Active client sockets. Readers use the current table without locking.
+ * Writers fill and clear slots in place, and only copy the table when a
+ * descriptor outgrows it, retiring the old one.
+ */
+struct {
+        Table *table;
+        int max;                /* one past the highest slot ever used */
+        pthread_mutex_t mutex;  /* serializes writers */
+} list;
+
+/* Something unpublished, to be released once no reader can still see it */
+typedef struct Retired Retired;
+struct Retired {
+        Retired *next;
+        void *ptr;
+        void (*release)(void *);
+        unsigned long epoch;    /* global epoch when it was retired */
+};
+
+/*
+ * Epoch-based reclamation. A reader records the global epoch in its slot
+ * while it is inside a read section, and 0 when it is not. An object
+ * retired at epoch e may be released once every busy slot is past e.
+ */
+struct {
+        unsigned long epoch;
+        unsigned long active[EBR_SLOTS];
+        int nslots;
+        pthread_mutex_t mutex;  /* guards nslots and limbo */
+        Retired *limbo;
+} ebr;
+static __thread int ebr_slot = -1;
+static __thread int ebr_depth;  /* read sections nest */
+
+/*
+ * Object pools, one per size class from 64 bytes up plus one for client
+ * nodes. Memory is mapped a slab at a time and is never given back, only
+ * reused. Every thread keeps a short free list per pool and trades
+ * batches with its NUMA node's depot for the pool, so the depot lock is
+ * only taken once every CACHE_BATCH allocations or frees. Slabs are
+ * placed on the node of the thread carving them, so what a worker takes
+ * is local to it; what it frees joins its own cache wherever it came
+ * from, which for anything but messages is almost always here anyway.
+ */
+#define POOL_NODE POOL_CLASSES
+#define POOL_COUNT (POOL_CLASSES+1)
+typedef struct {
+        pthread_mutex_t mutex;  /* guards the rest */
+        void *head;             /* free objects, linked through their start */
+        int len;
+        unsigned long objects;  /* carved from slabs so far */
+} Depot;
+typedef struct {
+        int size;               /* object size, a multiple of 64 */
+        Depot depots[NODES_MAX];        /* by NUMA node */
+} Pool;
+Pool pools[POOL_COUNT];
+
+/* A thread's own free objects for one pool */
+typedef struct {
+        void *head;
+        int len;
+} Cache;
+static __thread Cache *pool_cache;
+static __thread int pool_node;  /* whose depots this thread uses */
+
+/* Every thread's caches, for the statistics */
+struct {
+        Cache *caches[EBR_SLOTS];
+        int ncaches;
+        unsigned long bytes;    /* slab memory of all pools */
+        pthread_mutex_t mutex;  /* guards caches and ncaches */
+} pool;
+
+/*
+ * A thread's log lines waiting to be written, filled only by that thread
+ * and emptied only by log_run(), so neither side locks. A thread that
+ * finds its ring full drops the line rather than wait.
+ */
+typedef struct {
+        char lines[LOG_RING][LOG_LINE];
+        unsigned read, write;   /* free-running; LOG_RING is a power of 2 */
+        unsigned long lost;     /* lines dropped on a full ring */
+} LogRing;
+static __thread LogRing *log_ring;
+
+/* Lines this thread logged in the current second, for rate limiting */
+static __thread struct {
+        time_t sec;
+        int count;
+        unsigned long suppressed;       /* over LOG_RATE this second */
+} log_quota;
+
+/* Every thread's log ring */
+struct {
+        int async;              /* log_run() is draining the rings */
+        LogRing *rings[EBR_SLOTS];
+        int nrings;
+        pthread_mutex_t mutex;  /* guards rings and nrings */
+        unsigned long lost;     /* lines from threads without a ring */
+} logs;
+
+/*
+ * A link between nodes: ours to a peer, carrying what our clients say, or
+ * a peer's to us, carrying what its clients say. Each opens with the
+ * sender's node id, then sends batches of records of a room name (a
+ * length byte, then the name), a 32-bit big-endian length and the message
+ * as sent to clients, zlib-compressed behind an 8-byte header giving the
+ * compressed and then the raw size.
+ */
+typedef struct {
+        const char *host, *port;        /* the peer, or NULL for links in */
+        int sock;                       /* -1 while down */
+        int connecting;                 /* ours: connect() not done yet */
+        int hello;                      /* theirs: node id already read */
+        int self;                       /* ours: leads back to this node */
+        char *buf;                      /* to be sent, or not yet handled */
+        size_t len, off, cap;
+        time_t retry;                   /* ours: when to connect again */
+} Link;
+
+/*
+ * The cluster relay. Broadcasters append records to the queue; the relay
+ * thread takes all of it at once and sends it on in batches over every
+ * link, so a busy room costs one compressed write per peer per batch.
+ */
+struct {
+        uint64_t id;            /* this node, so it can spot links to itself */
+        int listener;           /* peers link to us here, or -1 */
+        int epfd, wakefd;
+        Link out[PEERS_MAX];
+        int nout;
+        pthread_mutex_t mutex;  /* guards the queue */
+        char *queue;            /* records for the next batch */
+        size_t qlen, qcap;
+        unsigned long dropped;  /* records that found the queue full */
+} relay;
+
+/*
+ * Hot restart. A process started with -U listens on that Unix socket for
+ * its successor, which connects on startup. The old process stops every
+ * thread that touches clients, lets the journal catch up and passes
+ * over its listeners, then every client with what it had read of the
+ * client's next message and what it had yet to send it, and exits.
+ */
+struct {
+        int listener;           /* for our successor, or -1 */
+        int sock;               /* to our predecessor while taking over */
+        int fds[HANDOFF_SLOTS]; /* listeners it handed us, or -1 */
+        int freezing;           /* threads handling clients are to stop */
+        int stopped;            /* how many have */
+        int helpers[2];         /* eventfds of the relay and TLS threads */
+        int nhelpers;
+        pthread_mutex_t mutex;  /* guards stopped */
+        pthread_cond_t cond;
+        pthread_t main;         /* the accept loop, interrupted by SIGUSR1 */
+} upgrade;
+
+/* What a process passes on about each client, ahead of its bytes */
+typedef struct {
+        int32_t in_len;                 /* partial message read */
+        int32_t out_len;                /* queued output not yet sent */
+        char room[ROOM_NAME_MAX+1];     /* "" for the lobby */
+} Handoff;
+
+/* Clients on their way to a successor, and the bytes that follow them */
+typedef struct {
+        int fds[HANDOFF_BATCH];
+        struct {
+                int32_t n;
+                Handoff h[HANDOFF_BATCH];
+        } head;                 /* sent as is, with the descriptors */
+        char *data;             /* each one's input, then its output */
+        size_t len, cap;
+        unsigned long total;    /* clients so far */
+} HandoffBatch;
+
+/*
+ * TLS. Accepted sockets go to a thread of their own for the handshake,
+ * so no worker waits on the crypto or on a slow client, and once it is
+ * done the session is handed to kernel TLS in both directions. What a
+ * worker gets back is a socket like any other: the kernel decrypts and
+ * encrypts inside the same read() and writev() calls, so the batched
+ * write paths and the hot restart handoff work on it unchanged.
+ */
+typedef struct Tls Tls;
+struct Tls {
+        Tls *next, *prev;       /* handshakes under way, oldest first */
+        int sock;
+        int armed;              /* registered with the thread's epoll */
+        SSL *ssl;
+        Worker *home;           /* worker to take it, or NULL for any */
+        unsigned long deadline;
+};
+
+struct {
+        SSL_CTX *ctx;
+        int epfd, wakefd;
+        pthread_mutex_t mutex;  /* guards incoming */
+        Tls *incoming;          /* accepted, not yet seen by the thread */
+        Tls *head, *tail;       /* the thread's own, by deadline */
+        int next;               /* round-robin for clients without a home */
+} tls;
+
+/*
+ * Samples in log-linear buckets: every value below HIST_SUB has a bucket
+ * of its own, and each power of 2 above is split HIST_SUB ways, so a
+ * bucket is never wider than 1/HIST_SUB of the values in it.
+ */
+typedef struct {
+        unsigned long counts[HIST_BUCKETS];
+        unsigned long count, sum;
+} Hist;
+
+/*
+ * What one thread has seen. Only that thread writes its counters, with
+ * plain relaxed stores, so counting costs no more than an increment; the
+ * admin thread adds up every thread's when asked.
+ */
+typedef struct {
+        unsigned long accepts;          /* clients taken on */
+        unsigned long rejects;          /* clients dropped for lack of memory */
+        unsigned long kicks;            /* clients closed on full queues */
+        unsigned long floods;           /* clients paused or closed for rate */
+        unsigned long stalls;           /* times every inbox was full */
+        unsigned long remote;           /* clients off their packets' node */
+        unsigned long handshakes;       /* TLS sessions handed to the kernel */
+        unsigned long tls_failures;     /* TLS clients dropped before that */
+        unsigned long pings;            /* idle clients pinged */
+        unsigned long idle_kicks;       /* clients closed for not answering */
+        unsigned long write_kicks;      /* clients closed for not reading */
+        unsigned long bytes_in, bytes_out;
+        unsigned long broadcasts;       /* messages sent to a room */
+        unsigned long queued, dropped;  /* copies queued and not */
+        Hist inbox_wait;                /* ns a socket sat in an inbox */
+        Hist delivery;                  /* ns from read to queued */
+        Hist depth;                     /* send queue length after queueing */
+} Metrics;
+static __thread Metrics *thread_metrics;
+
+/* Every thread's metrics, and the admin listener that reports them */
+struct {
+        Metrics *all[EBR_SLOTS];
+        int n;
+        Metrics spare;          /* shared by threads past EBR_SLOTS */
+        pthread_mutex_t mutex;  /* guards all and n */
+        int listener;
+} metrics;
+
+/*
+ * A message shared by every send queue it was broadcast to. The contents
+ * never change after msg_new(); the last queue to release it frees it.
+ * A message read back from the journal points into a mapping of it.
+ */
+typedef struct Msg {
+        int refs;
+        int len;
+        unsigned long born;     /* now_ns() when it was read */
+        char *data;             /* buf, or a journal segment mapped */
+        size_t map_len;         /* bytes mapped from data's page, or 0 */
+        char buf[];
+} Msg;
+
+/*
+ * A broadcast waiting to be journaled, or a client to catch up on a room
+ * from message seq up to until, once what is queued ahead is durable
+ */
+typedef struct JEntry JEntry;
+struct JEntry {
+        JEntry *next;
+        Msg *m;                 /* one reference, or NULL for a catch-up */
+        Node *p;                /* the client to catch up */
+        unsigned long seq, until;
+        char room[ROOM_NAME_MAX+1];
+};
+
+/*
+ * The journal file a room's messages are being appended to, and what of
+ * it is durable. A segment is named by the sequence number of its first
+ * message and holds consecutive messages exactly as they were sent, so a
+ * range of them goes out as one piece; its index file holds the offset
+ * after each message. Used by the journal thread alone.
+ */
+typedef struct Segment Segment;
+struct Segment {
+        Segment *next;
+        char room[ROOM_NAME_MAX+1];
+        unsigned long first;    /* seq of the first message */
+        unsigned long count;    /* messages written */
+        int fd, idx;            /* data and index files */
+        char *map;              /* the data file, mapped for writing */
+        size_t off;             /* bytes written */
+        size_t synced;          /* bytes known to be on disk */
+        uint64_t *ends;         /* offsets not yet in the index */
+        int nends, cap;
+};
+
+/*
+ * The journal. Broadcasters queue their messages in order under the
+ * room's mutex and never wait for the disk: journal_run() takes the whole
+ * queue at a time, copies it into the mapped segments and makes the batch
+ * durable with one msync() and one index fdatasync() per room, so the
+ * cost of a commit is shared by everything that piled up during the last
+ * one. When it falls JOURNAL_MAX behind, further messages are not kept.
+ */
+struct {
+        pthread_mutex_t mutex;  /* guards the queue and batch */
+        pthread_cond_t cond;    /* signalled when the queue fills */
+        JEntry *head, **tail;
+        int len;
+        JEntry *batch;          /* being written, not yet durable */
+        unsigned long lost;     /* dropped on a full queue */
+        unsigned long written;  /* made durable, or given up on */
+        Segment *segments;      /* open ones, journal thread only */
+} journal;
+
+/*
+ * A connected client. The send queue state every broadcaster touches is
+ * packed at the front, starting a cache line of its own; what follows is
+ * used by the owning worker alone.
+ */
+struct Node {
+        pthread_mutex_t mutex;  /* guards the send queue */
+        Msg **out;              /* ring of queued messages, NULL until used */
+        int out_cap;            /* slots in the ring, up to opts.out_max+1 */
+        int out_read, out_write;
+        int pending;            /* on w->pending, waiting for a flush */
+        int closing;            /* kicked by overflow policy or closed */
+        int out_off;            /* bytes of the head message already sent */
+        int out_busy;           /* head messages an io_uring write holds */
+        Worker *w;              /* reactor that owns the socket */
+        Node *pnext;
+
+        int sock;
+        Room *room;             /* current room, changed by its runner */
+        int room_slot;          /* index in room->members */
+        unsigned long room_seq; /* first message of the room not replayed */
+        int dead;               /* closed by its worker */
+        int ready;              /* EV_ bits waiting to be handled */
+        int queued;             /* on a run queue, or being run */
+        int inflight;           /* io_uring operations naming this node */
+        int sending;            /* an io_uring write is outstanding */
+        struct iovec *iov;      /* that write's vector */
+        char *in;               /* start of a partial line or frame */
+        int in_len, in_cap;
+        int in_held;            /* in has whole messages left for later */
+        int receiving;          /* an io_uring receive is armed */
+        /*
+         * Rate limits, kept as the time each of the client's buckets would
+         * refill if it sent nothing more. A client that has sent more than
+         * RATE_BURST seconds ahead of now is over its rate.
+         */
+        unsigned long msg_due, byte_due;
+        int parked;             /* on w->parked, and not being read from */
+        unsigned long resume;   /* when a parked client may be read again */
+        Node *park_next;
+        /*
+         * A join the journal is catching the client up for first. Nothing
+         * more is read from it until worker_fetched() hands it back.
+         */
+        Room *fetch_room;       /* the room it is joining, held */
+        unsigned long fetch_until;      /* where the room's history starts */
+        unsigned long fetch_upto;       /* one past the last it was sent */
+        int fetching;           /* the journal thread has it */
+        Node *fetch_next;
+        /*
+         * Timeouts, looked at by the owner when the timer goes off rather
+         * than rearmed on every read and write.
+         */
+        Timer timer;
+        unsigned long heard;    /* when the client last sent anything */
+        unsigned long ping_at;  /* when it was pinged, 0 if answered since */
+        unsigned long progress; /* last write, or when output was queued */
+} __attribute__((aligned(64)));
+
+int queue_init(void);
+Worker *queue_add(int sock, int cpu);
+static Worker *worker_near(int cpu, int room);
+static int sock_cpu(int sock);
+int queue_get(Worker *w);
+void queue_wait(void);
+
+static int queue_size(Worker *w);
+static int queue_full(void);
+
+void list_init(void);
+void list_delete(Node *p);
+Node *list_append(int sock, Worker *w);
+static Table *table_new(int cap);
+Node *list_lookup(int sock);
+int list_send(int sock, Msg *m);
+
+void room_init(void);
+Room *room_get(const char *name);
+Room *room_find(const char *name);
+void room_put(Room *r);
+int room_join(Node *p, Room *r, long since);
+void room_leave(Node *p);
+int room_broadcast(Room *r, Msg *m, Node *except);
+
+static unsigned room_hash(const char *name);
+static Room *room_hold(Room *r, int n);
+static Room *room_lookup(unsigned shard, const char *name);
+static Room *room_new(const char *name);
+static JRoom *room_numbering(unsigned shard, const char *name);
+static void room_free(void *arg);
+static int room_resize(Part *part, int cap);
+static int room_deliver(Part *part, Msg *m, Node *except,
+                        unsigned long seq);
+static unsigned long room_record(Room *r, Msg *m);
+static int room_enter(Node *p, Room *r, long since, int fetch);
+static void room_replay(Room *r, Node *p, long since);
+
+int journal_init(void);
+int journal_start(void);
+void *journal_run(void *arg);
+void journal_scan(void);
+void journal_append(Room *r, Msg *m, unsigned long seq);
+int journal_fetch(Node *p, Room *r, long since, unsigned long until);
+long journal_replay(Node *p, const char *room, long since,
+                    unsigned long until);
+static void journal_write(JEntry *e);
+static void journal_serve(JEntry *e);
+static void journal_path(char *buf, int size, const char *room,
+                         unsigned long first, const char *ext);
+static int journal_segments(const char *room, unsigned long **firsts);
+static int seq_cmp(const void *a, const void *b);
+static unsigned long segment_count(const char *room, unsigned long first);
+static Segment *segment_open(const char *room, unsigned long first);
+static void segment_commit(Segment *s);
+static void segment_close(Segment *s);
+
+int relay_init(int listener, char **peers, int npeers);
+void *relay_run(void *arg);
+void relay_publish(Room *r, Msg *m);
+static void relay_flush(void);
+static int relay_deliver(char *z, uint32_t zlen, uint32_t rawlen);
+static void link_connect(Link *l);
+static int link_queue(Link *l, const void *data, size_t len);
+static void link_write(Link *l);
+static void link_down(Link *l);
+static void link_accept(void);
+static void link_read(Link *l);
+static int link_grow(Link *l);
+static void link_self(Link *l);
+
+int upgrade_init(void);
+int upgrade_connect(void);
+void *upgrade_run(void *arg);
+void upgrade_stop(void);
+static int upgrade_listen(int slot, const char *host, const char *port,
+                          int *family);
+static int upgrade_take(void);
+static int upgrade_adopt(void);
+static int upgrade_handoff(int sock);
+static int upgrade_add(HandoffBatch *b, int sock, Node *p, int out);
+static int upgrade_flush(HandoffBatch *b, int out);
+static int upgrade_send(int sock, int *fds, int n, void *buf, size_t len);
+static int upgrade_recv(int sock, int *fds, int max, void *buf, size_t len);
+static int upgrade_full(int sock, void *buf, size_t len, int out);
+static void upgrade_signal(int sig);
+
+int tls_init(void);
+void *tls_run(void *arg);
+static void tls_add(int sock, Worker *home);
+static void tls_step(Tls *t);
+static void tls_done(Tls *t);
+static void tls_drop(Tls *t, const char *why);
+static void tls_unlink(Tls *t);
+static void tls_take(Worker *w);
+
+void pool_init(void);
+void *pool_get(int id);
+void pool_put(int id, void *obj);
+void *pool_alloc(int size);
+void pool_free(void *obj, int size);
+static int pool_class(int size);
+static int pool_refill(int id);
+static Cache *pool_caches(void);
+static void *pool_slab(size_t len);
+
+void ebr_init(void);
+int ebr_register(void);
+void ebr_enter(void);
+void ebr_exit(void);
+void ebr_retire(void *ptr, void (*release)(void *));
+void ebr_reclaim(void);
+
+Msg *msg_new(char *buf, int len);
+Msg *msg_frame(int type, char *buf, int len);
+Msg *msg_hold(Msg *m);
+void msg_put(Msg *m);
+int node_enqueue(Node *p, Msg *m);
+int node_flush(Node *p);
+
+static int out_size(Node *p);
+static int out_grow(Node *p);
+static void out_trim(Node *p);
+static void node_schedule(Node *p);
+static void node_free(void *arg);
+static void node_account(Node *p, long bytes);
+
+int worker_init(Worker *w);
+void worker_wake(Worker *w);
+static void worker_accept(Worker *w);
+static void worker_listen(Worker *w);
+static Node *worker_add(Worker *w, int sock);
+static void worker_pin(Worker *w);
+static int listen_on(const char *host, const char *port, int *family);
+static void worker_work(Worker *w);
+static void worker_help(Worker *w);
+static void worker_fanout(Worker *w);
+static void worker_tick(Worker *w);
+
+static void wheel_add(Wheel *wh, Timer *t, unsigned long expires);
+static void wheel_del(Wheel *wh, Timer *t);
+static void wheel_advance(Wheel *wh, unsigned long tick, Timer **expired);
+static void node_arm(Node *p, unsigned long due);
+static void node_timeout(Node *p, unsigned long now);
+static void node_kick(Node *p);
+
+static int runq_init(RunQueue *q);
+static int runq_push(RunQueue *q, Node *p);
+static Node *runq_pop(RunQueue *q);
+static int runq_size(RunQueue *q);
+static void task_mark(Node *p, int ev);
+static void task_run(Node *p);
+
+void *stats_run(void *arg);
+static void stats_pools(void);
+static void stats_clients(void);
+static unsigned long now_ns(void);
+static void worker_flush(Worker *w);
+static void worker_fetched(Worker *w);
+static void client_close(Node *p);
+static int set_nonblock(int sock);
+static void raise_fd_limit(void);
+
+void logger(const char *format, ...);
+void logger_at(int level, const char *format, ...);
+void log_errno(const char *what);
+void log_init(void);
+int log_start(void);
+void *log_run(void *arg);
+static void log_line(int level, const char *format, va_list ap);
+static void log_put(const char *line, int len);
+static LogRing *log_rings(void);
+static void log_out(const char *buf, int len);
+
+void metrics_init(void);
+void *admin_run(void *arg);
+static Metrics *metrics_local(void);
+static void metric_add(unsigned long *counter, unsigned long n);
+static void hist_add(Hist *h, unsigned long v);
+static int hist_bucket(unsigned long v);
+static void metrics_write(FILE *f);
+static void hist_merge(Hist *to, Hist *from);
+static void metrics_hist(FILE *f, const char *name, const char *help,
+                         Hist *h, int first, double scale);
+static void admin_serve(int sock);
+static int parse_overflow(const char *name);
+static int parse_level(const char *name);
+static int parse_num(const char *s, unsigned long *n);
+static int set_threads(const char *value);
+static int set_inbox(const char *value);
+static int set_read_size(const char *value);
+static int set_backlog(const char *value);
+static int set_queue(const char *value);
+static int set_history(const char *value);
+static int set_overflow(const char *value);
+static int set_memory(const char *value);
+static int set_msg_rate(const char *value);
+static int set_byte_rate(const char *value);
+static int set_flood(const char *value);
+static int set_log_level(const char *value);
+static int set_pin(const char *value);
+static int parse_switch(const char *value);
+static int set_tuning(const char *value);
+static int set_nodelay(const char *value);
+static int set_cork(const char *value);
+static int set_sockopt(int *opt, const char *value);
+static int set_sndbuf(const char *value);
+static int set_rcvbuf(const char *value);
+static int set_notsent_lowat(const char *value);
+static int set_busy_poll(const char *value);
+static int set_defer_accept(const char *value);
+static int set_tls_cert(const char *value);
+static int set_tls_key(const char *value);
+static int set_idle(const char *value);
+static int set_stall(const char *value);
+static void tune_listener(int sock);
+static void tune_client(int sock);
+int config_load(const char *path, int reload);
+void *config_run(void *arg);
+void topo_init(void);
+static void log_peer(struct sockaddr_storage *sa);
+
+int uring_init(Worker *w);
+void uring_run(Worker *w);
+int uring_send(Worker *w, Node *p);
+static struct io_uring_sqe *uring_sqe(Ring *r);
+static int uring_enter(Ring *r, int wait);
+static void uring_complete(Worker *w, struct io_uring_cqe *cqe);
+static int uring_sent(Worker *w, Node *p, int res);
+static void uring_recv(Worker *w, Node *p);
+static void uring_resume(Worker *w, Node *p);
+static void uring_timer(Worker *w);
+static void uring_accept(Worker *w);
+static void uring_poll_wake(Worker *w);
+static void uring_buf_return(Ring *r, int bid);
+
+void *run(void *arg);
+int chat_loop(Node *p);
+int chat_input(Node *p, char *buf, int len);
+int chat_command(Node *p, char *line);
+int chat_frames(Node *p, char *buf, int len);
+int chat_lines(Node *p, char *buf, int len);
+static int chat_resume(Node *p);
+int chat_line(Node *p, char *line, int len);
+int chat_frame(Node *p, int type, char *data, int len);
+int chat_join(Node *p, const char *name, long since);
+static int chat_joined(Node *p);
+void chat_fetched(Node *p);
+static int room_move(Node *p, const char *name, long since);
+static int room_lobby(Node *p);
+void chat_send(Node *p, Msg *m);
+static void node_charge(Node *p, int len);
+static unsigned long node_over(Node *p);
+static int node_park(Node *p, unsigned long until);
+static void worker_unpark(Worker *w);
+int chat_reply(Node *p, const char *text);
+
+static int in_reserve(Node *p, int len);
+static void in_trim(Node *p);
+
+void line_init(void);
+static int line_find_memchr(const char *buf, int len);
+#ifdef __x86_64__
+static unsigned long line_time(int (*find)(const char *, int),
+                               const char *buf, int len);
+static int line_find_sse2(const char *buf, int len);
+static int line_find_avx2(const char *buf, int len);
+#endif
+
+/* Log at LOG_INFO */
+void logger(const char *format, ...) {
+        va_list ap;
+
+        va_start(ap, format);
+        log_line(LOG_INFO, format, ap);
+        va_end(ap);
+}
+
+/* Log at the given level */
+void logger_at(int level, const char *format, ...) {
+        va_list ap;
+
+        va_start(ap, format);
+        log_line(level, format, ap);
+        va_end(ap);
+}
+
+/* Like perror(), but through the log */
+void log_errno(const char *what) {
+        logger_at(LOG_ERROR, "%s: %s", what, strerror(errno));
+}
+
+/*
+ * Format a line and send it on, unless it is above the log level or
+ * this thread has already logged LOG_RATE lines this second. The count
+ * of lines held back goes out ahead of the thread's next line after it.
+ */
+static void log_line(int level, const char *format, va_list ap) {
+        char line[LOG_LINE];
+        struct timespec ts;
+        int n;
+
+        if (level > opts.log_level)
+                return;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        if (ts.tv_sec != log_quota.sec) {
+                if (log_quota.suppressed) {
+                        n = snprintf(line, sizeof(line), "sup: %lu lines "
+                                     "suppressed\n", log_quota.suppressed);
+                        log_put(line, n);
+                }
+                log_quota.sec = ts.tv_sec;
+                log_quota.count = 0;
+                log_quota.suppressed = 0;
+        }
+        if (log_quota.count++ == LOG_RATE) {
+                log_quota.count--;
+                log_quota.suppressed++;
+                return;
+        }
+        n = snprintf(line, sizeof(line), "sup: ");
+        n += vsnprintf(line + n, sizeof(line) - n, format, ap);
+        if (n > sizeof(line) - 2)
+                n = sizeof(line) - 2;
+        line[n++] = '\n';
+        line[n] = '\0';
+        log_put(line, n);
+}
+
+/*
+ * Write a line out with a single write(), or in async mode queue it on
+ * this thread's ring, never waiting for room.
+ */
+static void log_put(const char *line, int len) {
+        LogRing *r;
+        unsigned w;
+
+        if (!__atomic_load_n(&logs.async, __ATOMIC_ACQUIRE)) {
+                log_out(line, len);
+                return;
+        }
+        r = log_rings();
+        if (r == NULL) {
+                __atomic_add_fetch(&logs.lost, 1, __ATOMIC_RELAXED);
+                return;
+        }
+        w = r->write;
+        if (w - __atomic_load_n(&r->read, __ATOMIC_ACQUIRE) == LOG_RING) {
+                __atomic_store_n(&r->lost, r->lost + 1, __ATOMIC_RELAXED);
+                return;
+        }
+        memcpy(r->lines[w % LOG_RING], line, len + 1);
+        __atomic_store_n(&r->write, w + 1, __ATOMIC_RELEASE);
+}
+
+/* Return this thread's log ring, making it the first time, or NULL */
+static LogRing *log_rings(void) {
+        if (log_ring != NULL)
+                return log_ring;
+        pthread_mutex_lock(&logs.mutex);
+        if (logs.nrings < EBR_SLOTS) {
+                log_ring = calloc(1, sizeof(LogRing));
+                if (log_ring != NULL)
+                        logs.rings[logs.nrings++] = log_ring;
+        }
+        pthread_mutex_unlock(&logs.mutex);
+        return log_ring;
+}
+
+/* Set up the ring registry; logging is synchronous until log_start() */
+void log_init(void) {
+        logs.async = 0;
+        logs.nrings = 0;
+        pthread_mutex_init(&logs.mutex, NULL);
+}
+
+/* Start the thread that drains every ring, switching to async logging */
+int log_start(void) {
+        pthread_t th;
+
+        if (pthread_create(&th, NULL, log_run, NULL))
+                return -1;
+        pthread_detach(th);
+        __atomic_store_n(&logs.async, 1, __ATOMIC_RELEASE);
+        return 0;
+}
+
+/*
+ * Copy out whatever every thread has logged, a batch to each write(),
+ * noting lines dropped since the last pass, then sleep a little if there
+ * was nothing.
+ */
+void *log_run(void *arg) {
+        struct timespec nap = { 0, LOG_DRAIN_MS * 1000000L };
+        char batch[LOG_RING * LOG_LINE / 4];
+        unsigned long lost, reported = 0;
+        unsigned r, w;
+        int i, n, len, busy;
+        LogRing *ring;
+
+        while (1) {
+                busy = 0;
+                len = 0;
+                lost = __atomic_load_n(&logs.lost, __ATOMIC_RELAXED);
+                pthread_mutex_lock(&logs.mutex);
+                n = logs.nrings;
+                pthread_mutex_unlock(&logs.mutex);
+                for (i = 0; i < n; i++) {
+                        ring = logs.rings[i];
+                        lost += __atomic_load_n(&ring->lost, __ATOMIC_RELAXED);
+                        r = ring->read;
+                        w = __atomic_load_n(&ring->write, __ATOMIC_ACQUIRE);
+                        for (; r != w; r++) {
+                                if (len + LOG_LINE > sizeof(batch)) {
+                                        log_out(batch, len);
+                                        len = 0;
+                                }
+                                len += stpcpy(batch + len,
+                                              ring->lines[r % LOG_RING])
+                                       - (batch + len);
+                                busy = 1;
+                        }
+                        __atomic_store_n(&ring->read, r, __ATOMIC_RELEASE);
+                }
+                if (lost != reported) {
+                        len += snprintf(batch + len, sizeof(batch) - len,
+                                        "sup: log full, %lu lines lost\n",
+                                        lost - reported);
+                        reported = lost;
+                }
+                log_out(batch, len);
+                if (!busy)
+                        nanosleep(&nap, NULL);
+        }
+        return NULL;
+}
+
+/* Write all of buf to stderr */
+static void log_out(const char *buf, int len) {
+        int n;
+
+        while (len > 0) {
+                n = write(STDERR_FILENO, buf, len);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return;
+                }
+                buf += n;
+                len -= n;
+        }
+}
+
+int main(int argc, char *argv[]) {
+        struct sockaddr_storage sa;
+        socklen_t len;
+        int family;
+        int listener = -1, client, i, opt;
+        char *cluster = NULL, *peers[PEERS_MAX];
+        int npeers = 0;
+        pthread_t worker_th;
+        sigset_t hup;
+
+        log_init();
+        while ((opt = getopt(argc, argv, "Aa:B:b:C:ce:f:H:I:i:j:K:kl:LM:m:"
+                             "o:P:p:q:R:rS:s:T:t:U:w:")) != -1) {
+                switch (opt) {
+                case 'A':
+                        opts.pin = 1;
+                        break;
+                case 'a':
+                        opts.admin = optarg;
+                        break;
+                case 'C':
+                        cluster = optarg;
+                        break;
+                case 'P':
+                        if (npeers == PEERS_MAX)
+                                goto usage;
+                        peers[npeers++] = optarg;
+                        break;
+                case 'B':
+                        if (set_byte_rate(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'M':
+                        if (set_msg_rate(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'K':
+                        opts.tls_key = optarg;
+                        break;
+                case 'k':
+                        opts.flood_kick = 1;
+                        break;
+                case 'b':
+                        if (set_backlog(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'e':
+                        if (!strcmp(optarg, "epoll"))
+                                opts.engine = ENGINE_EPOLL;
+                        else if (!strcmp(optarg, "uring"))
+                                opts.engine = ENGINE_URING;
+                        else
+                                goto usage;
+                        break;
+                case 'f':
+                        /* Later options override what the file says */
+                        opts.config = optarg;
+                        if (config_load(optarg, 0) < 0)
+                                return -1;
+                        break;
+                case 'H':
+                        if (set_history(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'I':
+                        if (set_inbox(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'i':
+                        if (set_idle(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'j':
+                        opts.journal = optarg;
+                        break;
+                case 'l':
+                        if (set_log_level(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'L':
+                        opts.log_async = 1;
+                        break;
+                case 'm':
+                        if (set_memory(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'o':
+                        if (set_overflow(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'p':
+                        if (!strcmp(optarg, "raw"))
+                                opts.proto = PROTO_RAW;
+                        else if (!strcmp(optarg, "lines"))
+                                opts.proto = PROTO_LINES;
+                        else if (!strcmp(optarg, "framed"))
+                                opts.proto = PROTO_FRAMED;
+                        else
+                                goto usage;
+                        break;
+                case 'q':
+                        if (set_queue(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'R':
+                        if (set_read_size(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'c':
+                        opts.compact = 1;
+                        break;
+                case 'r':
+                        opts.reuseport = 1;
+                        break;
+                case 'S':
+                        opts.tls_cert = optarg;
+                        break;
+                case 's':
+                        opts.stats = atoi(optarg);
+                        if (opts.stats <= 0)
+                                goto usage;
+                        break;
+                case 'T':
+                        if (set_tuning(optarg) < 0)
+                                goto usage;
+                        break;
+                case 't':
+                        if (set_threads(optarg) < 0)
+                                goto usage;
+                        break;
+                case 'U':
+                        opts.upgrade = optarg;
+                        break;
+                case 'w':
+                        if (set_stall(optarg) < 0)
+                                goto usage;
+                        break;
+                default:
+                        goto usage;
+                }
+        }
+        if (argc - optind != 2) {
+usage:
+                printf("Usage: %s [-AckLr] [-a admin port] [-b backlog] "
+                       "[-B bytes/sec] [-M messages/sec] "
+                       "[-C cluster port] [-P peer host:port]... "
+                       "[-e epoll|uring] [-f config file] [-H history] "
+                       "[-I inbox len] [-i idle secs] [-j journal dir] "
+                       "[-l error|warn|info|debug] [-m megabytes] "
+                       "[-o oldest|newest|disconnect] [-p raw|lines|framed] "
+                       "[-q len] [-R read size] [-S cert file] [-K key file] "
+                       "[-s secs] [-T default|latency|throughput] "
+                       "[-t threads] [-w write timeout secs] "
+                       "[-U upgrade socket] <ip> <port>\n", argv[0]);
+                return -1;
+        }
+        /* A replay has to fit in the send queue */
+        if (opts.history > opts.out_max)
+                opts.history = opts.out_max;
+        argv += optind-1;
+        /* Only config_run() takes SIGHUP, so block it before any thread */
+        if (opts.config != NULL) {
+                sigemptyset(&hup);
+                sigaddset(&hup, SIGHUP);
+                pthread_sigmask(SIG_BLOCK, &hup, NULL);
+        }
+        topo_init();
+        if (opts.threads == 0)
+                opts.threads = topo.ncpus < THREADS_MAX ? topo.ncpus
+                        : THREADS_MAX;
+        logger("%d workers over %d CPUs on %d NUMA nodes", opts.threads,
+               topo.ncpus, topo.nnodes);
+
+        /* Take over from a running server, if there is one */
+        for (i = 0; i < HANDOFF_SLOTS; i++)
+                upgrade.fds[i] = -1;
+        upgrade.sock = upgrade.listener = -1;
+        if (opts.upgrade != NULL && (upgrade.sock = upgrade_connect()) >= 0
+            && upgrade_take() < 0) {
+                logger_at(LOG_ERROR, "server on %s handed nothing over",
+                          opts.upgrade);
+                return -1;
+        }
+
+        /* One listener per worker in reuseport mode, else one shared */
+        for (i = 0; i < opts.threads; i++) {
+                if (i == 0 || opts.reuseport)
+                        listener = upgrade_listen(i, argv[1], argv[2],
+                                                  &family);
+                if (listener < 0) {
+                        logger_at(LOG_ERROR, "unable to bind address");
+                        return -1;
+                }
+                if (i == 0 || opts.reuseport)
+                        tune_listener(listener);
+                workers[i].id = i;
+                workers[i].cpu = topo.order[i % topo.ncpus];
+                workers[i].node = topo.node[workers[i].cpu];
+                workers[i].listener = listener;
+                /* Have the kernel pick the listener on the packets' CPU */
+                if (opts.pin && opts.reuseport
+                    && setsockopt(listener, SOL_SOCKET, SO_INCOMING_CPU,
+                                  &workers[i].cpu, sizeof(int)) < 0)
+                        log_errno("SO_INCOMING_CPU");
+        }
+        if (family == AF_INET6)
+                logger("IPv6 detected!");
+        else
+                logger("IPv4 only...");
+        logger("listening on %s %s", argv[1], argv[2]);
+        metrics.listener = -1;
+        if (opts.admin != NULL) {
+                metrics.listener = upgrade_listen(HANDOFF_ADMIN, argv[1],
+                                                  opts.admin, &family);
+                if (metrics.listener < 0) {
+                        logger_at(LOG_ERROR, "unable to bind admin address");
+                        return -1;
+                }
+                logger("serving metrics on %s %s", argv[1], opts.admin);
+        }
+        relay.listener = -1;
+        if (cluster != NULL) {
+                relay.listener = upgrade_listen(HANDOFF_CLUSTER, argv[1],
+                                                cluster, &family);
+                if (relay.listener < 0 || set_nonblock(relay.listener) < 0) {
+                        logger_at(LOG_ERROR, "unable to bind cluster address");
+                        return -1;
+                }
+                logger("linking peers on %s %s", argv[1], cluster);
+        }
+
+        /* Concurrent clients are bounded by descriptors, not threads */
+        raise_fd_limit();
+        /* A peer hanging up mid-write shows up as EPIPE, not a signal */
+        signal(SIGPIPE, SIG_IGN);
+
+        /* Start reactor pool */
+        if (queue_init() < 0) {
+                log_errno("queue_init");
+                return -1;
+        }
+        metrics_init();
+        pool_init();
+        ebr_init();
+        if (opts.journal && (journal_init() < 0 || journal_start() < 0)) {
+                log_errno(opts.journal);
+                return -1;
+        }
+        list_init();
+        room_init();
+        line_init();
+        for (i = 0; i < opts.threads; i++) {
+                if (worker_init(&workers[i]) < 0) {
+                        log_errno("worker_init");
+                        return -1;
+                }
+        }
+        /* Workers hand TLS listeners' clients over from the start */
+        if (opts.tls_cert != NULL) {
+                if (tls_init() < 0)
+                        return -1;
+                if (pthread_create(&worker_th, NULL, tls_run, NULL)) {
+                        log_errno("pthread_create");
+                        return -1;
+                }
+                pthread_detach(worker_th);
+                upgrade.helpers[upgrade.nhelpers++] = tls.wakefd;
+        }
+        /* Adopted clients are registered before their workers run */
+        if (upgrade.sock >= 0 && upgrade_adopt() < 0)
+                return -1;
+        for (i = 0; i < opts.threads; i++) {
+                logger("starting thread %d", i);
+                if (pthread_create(&worker_th, NULL, run, &workers[i]))
+                        log_errno("pthread_create");
+                else if (pthread_detach(worker_th))
+                        log_errno("pthread_detach");
+                else
+                        continue;
+                close(listener);
+                return -1;
+        }
+        if (opts.stats) {
+                if (pthread_create(&worker_th, NULL, stats_run, NULL))
+                        log_errno("pthread_create");
+                else
+                        pthread_detach(worker_th);
+        }
+        if (cluster != NULL || npeers) {
+                if (relay_init(relay.listener, peers, npeers) < 0) {
+                        logger_at(LOG_ERROR, "unable to set up the relay");
+                        return -1;
+                }
+                if (pthread_create(&worker_th, NULL, relay_run, NULL)) {
+                        log_errno("pthread_create");
+                } else {
+                        pthread_detach(worker_th);
+                        upgrade.helpers[upgrade.nhelpers++] = relay.wakefd;
+                }
+        }
+        if (metrics.listener >= 0) {
+                if (pthread_create(&worker_th, NULL, admin_run, NULL))
+                        log_errno("pthread_create");
+                else
+                        pthread_detach(worker_th);
+        }
+        if (opts.config != NULL) {
+                if (pthread_create(&worker_th, NULL, config_run, NULL))
+                        log_errno("pthread_create");
+                else
+                        pthread_detach(worker_th);
+        }
+        if (opts.log_async && log_start() < 0)
+                log_errno("pthread_create");
+        if (opts.upgrade != NULL && upgrade_init() < 0) {
+                log_errno(opts.upgrade);
+                return -1;
+        }
+        /* io_uring and reuseport workers accept for themselves */
+        if (opts.engine == ENGINE_URING || opts.reuseport) {
+                while (1)
+                        pause();
+        }
+        /* Accept connections and pass sockets to queue */
+        while (1) {
+                if (__atomic_load_n(&upgrade.freezing, __ATOMIC_SEQ_CST))
+                        upgrade_stop();
+                /* Leave new connections in the listen queue until one fits */
+                if (queue_full()) {
+                        metric_add(&metrics_local()->stalls, 1);
+                        queue_wait();
+                }
+                len = sizeof(sa);
+                client = accept(listener, (struct sockaddr *)&sa, &len);
+                if (client < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        log_errno("accept");
+                        break;
+                }
+                log_peer(&sa);
+                if (opts.tls_cert != NULL)
+                        tls_add(client, opts.pin ? worker_near(sock_cpu(client),
+                                                               0) : NULL);
+                else
+                        worker_wake(queue_add(client, opts.pin
+                                              ? sock_cpu(client) : -1));
+        }
+        close(listener);
+        return 0;
+}
+
+/* Create the eventfd the accept loop sleeps on while every inbox is full */
+int queue_init(void) {
+        queue.next = 0;
+        queue.waiting = 0;
+        queue.spacefd = eventfd(0, 0);
+        return queue.spacefd < 0 ? -1 : 0;
+}
+
+/* Get a socket from a worker's inbox, or -1 if there is nothing waiting */
+int queue_get(Worker *w) {
+        Inbox *q = &w->inbox;
+        uint64_t one = 1;
+        int sock;
+
+        if (!queue_size(w))
+                return -1;
+        sock = q->sockets[q->read % opts.inbox];
+        hist_add(&metrics_local()->inbox_wait,
+                 now_ns() - q->stamps[q->read % opts.inbox]);
+        __atomic_store_n(&q->read, q->read+1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&queue.waiting, __ATOMIC_SEQ_CST)
+            && write(queue.spacefd, &one, sizeof(one)) < 0)
+                log_errno("eventfd write");
+        return sock;
+}
+
+/*
+ * Add socket to the inbox of a worker with room, the one worker_near()
+ * picks for cpu. Returns that worker, or NULL if every inbox is full.
+ */
+Worker *queue_add(int sock, int cpu) {
+        Worker *w;
+
+        w = worker_near(cpu, 1);
+        if (w == NULL)
+                return NULL;
+        w->inbox.sockets[w->inbox.write % opts.inbox] = sock;
+        w->inbox.stamps[w->inbox.write % opts.inbox] = now_ns();
+        __atomic_store_n(&w->inbox.write, w->inbox.write+1, __ATOMIC_RELEASE);
+        return w;
+}
+
+/*
+ * Pick a worker for a client whose packets are processed on cpu: the
+ * next round-robin on that CPU's NUMA node, or on any node if there is
+ * none with room or cpu is -1. Going round within the node, not straight
+ * to the worker on cpu, keeps a single busy receive queue from piling
+ * every client on one worker. With room set, only workers with space in
+ * their inboxes count. Returns NULL if none does.
+ */
+static Worker *worker_near(int cpu, int room) {
+        Worker *w = NULL, *any = NULL;
+        int i;
+
+        for (i = 0; i < opts.threads; i++) {
+                w = &workers[(queue.next + i) % opts.threads];
+                if (room && queue_size(w) == opts.inbox)
+                        continue;
+                if (cpu < 0 || w->node == topo.node[cpu])
+                        break;
+                if (any == NULL)
+                        any = w;
+        }
+        if (i == opts.threads)
+                w = any;
+        if (w != NULL)
+                queue.next = (w->id + 1) % opts.threads;
+        return w;
+}
+
+/* The CPU a socket's packets are processed on, or -1 if not known yet */
+static int sock_cpu(int sock) {
+        socklen_t len = sizeof(int);
+        int cpu;
+
+        if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0
+            || cpu < 0 || cpu >= CPU_SETSIZE)
+                return -1;
+        return cpu;
+}
+
+/* Block the accept loop until some worker drains its inbox */
+void queue_wait(void) {
+        uint64_t count;
+
+        logger_at(LOG_WARN, "all workers backed up, pausing accept");
+        __atomic_store_n(&queue.waiting, 1, __ATOMIC_SEQ_CST);
+        while (queue_full()) {
+                if (__atomic_load_n(&upgrade.freezing, __ATOMIC_SEQ_CST))
+                        upgrade_stop();
+                if (read(queue.spacefd, &count, sizeof(count)) < 0
+                    && errno != EINTR)
+                        break;
+        }
+        __atomic_store_n(&queue.waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Return the number of sockets in a worker's inbox */
+static int queue_size(Worker *w) {
+        return __atomic_load_n(&w->inbox.write, __ATOMIC_ACQUIRE)
+                - __atomic_load_n(&w->inbox.read, __ATOMIC_SEQ_CST);
+}
+
+/* Return whether no inbox has room */
+static int queue_full(void) {
+        int i;
+
+        for (i = 0; i < opts.threads; i++)
+                if (queue_size(&workers[i]) < opts.inbox)
+                        return 0;
+        return 1;
+}
+
+/* Initialize synchronization variables and publish an empty table. */
+void list_init(void) {
+        list.table = table_new(TABLE_MIN);
+        list.max = 0;
+        pthread_mutex_init(&list.mutex, NULL);
+}
+
+/* Allocate a table of free slots in one block */
+static Table *table_new(int cap) {
+        Table *t;
+        int i;
+
+        t = malloc(sizeof(Table) + cap * sizeof(Node *));
+        if (t == NULL)
+                return NULL;
+        t->cap = cap;
+        t->node = (Node **)(t+1);
+        for (i = 0; i < cap; i++)
+                t->node[i] = NULL;
+        return t;
+}
+
+/* Append an active socket owned by worker w to the socket list. */
+Node *list_append(int sock, Worker *w) {
+        Table *t, *old;
+        Node *p;
+        int cap;
+
+        p = pool_get(POOL_NODE);
+        if (p == NULL)
+                return NULL;
+        memset(p, 0, sizeof(Node));
+        p->sock = sock;
+        p->w = w;
+        __atomic_add_fetch(&w->clients, 1, __ATOMIC_RELAXED);
+        node_account(p, sizeof(Node));
+        pthread_mutex_init(&p->mutex, NULL);
+        if (room_join(p, room_hold(lobby, 1), -1) < 0) {
+                room_put(lobby);
+                node_free(p);
+                return NULL;
+        }
+
+        pthread_mutex_lock(&list.mutex);
+        old = list.table;
+        if (sock >= old->cap) {
+                for (cap = old->cap; cap <= sock; cap *= 2)
+                        ;
+                t = table_new(cap);
+                if (t == NULL) {
+                        pthread_mutex_unlock(&list.mutex);
+                        room_leave(p);
+                        ebr_retire(p, node_free);
+                        return NULL;
+                }
+                memcpy(t->node, old->node, old->cap * sizeof(Node *));
+                __atomic_store_n(&list.table, t, __ATOMIC_SEQ_CST);
+                ebr_retire(old, free);
+        }
+        t = list.table;
+        __atomic_store_n(&t->node[sock], p, __ATOMIC_RELEASE);
+        if (sock >= list.max)
+                __atomic_store_n(&list.max, sock+1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&list.mutex);
+        metric_add(&metrics_local()->accepts, 1);
+        return p;
+}
+
+/*
+ * Delete a dead client from the socket list. The node is not freed;
+ * broadcasters may still be holding it.
+ */
+void list_delete(Node *p) {
+        Table *t;
+
+        pthread_mutex_lock(&list.mutex);
+        t = list.table;
+        if (t->node[p->sock] == p)
+                __atomic_store_n(&t->node[p->sock], NULL, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&list.mutex);
+}
+
+/*
+ * Find the client on a socket. Only valid inside a read section, and the
+ * client may already be closing.
+ */
+Node *list_lookup(int sock) {
+        Table *t = __atomic_load_n(&list.table, __ATOMIC_SEQ_CST);
+
+        if (sock < 0 || sock >= t->cap)
+                return NULL;
+        return __atomic_load_n(&t->node[sock], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Queue a message for the client on one socket. Takes over the caller's
+ * reference to m. Returns -1 if there is no such client or it refused.
+ */
+int list_send(int sock, Msg *m) {
+        Node *p;
+        int ret = -1;
+
+        ebr_enter();
+        p = list_lookup(sock);
+        if (p != NULL)
+                ret = node_enqueue(p, m);
+        else
+                msg_put(m);
+        ebr_exit();
+        return ret;
+}
+
+/* Set up the shards and the lobby, which is pinned so it never goes */
+void room_init(void) {
+        int i;
+
+        for (i = 0; i < ROOM_SHARDS; i++) {
+                pthread_mutex_init(&shards[i].mutex, NULL);
+                shards[i].rooms = NULL;
+        }
+        if (opts.journal)
+                journal_scan();
+        lobby = room_get("lobby");
+        if (lobby == NULL) {
+                logger_at(LOG_ERROR, "unable to create lobby");
+                exit(1);
+        }
+}
+
+/* FNV-1a, to pick a room's shard */
+static unsigned room_hash(const char *name) {
+        unsigned h = 2166136261u;
+
+        while (*name)
+                h = (h ^ (unsigned char)*name++) * 16777619u;
+        return h;
+}
+
+/* Find a room in a shard, with its lock held */
+static Room *room_lookup(unsigned shard, const char *name) {
+        Room *r;
+
+        for (r = shards[shard].rooms; r != NULL; r = r->next)
+                if (!strcmp(r->name, name))
+                        break;
+        return r;
+}
+
+/*
+ * Find a room by name, creating it if needed, and take a reference that
+ * keeps it alive. Returns NULL if it could not be made.
+ */
+Room *room_get(const char *name) {
+        unsigned shard = room_hash(name) % ROOM_SHARDS;
+        Room *r;
+
+        pthread_mutex_lock(&shards[shard].mutex);
+        r = room_lookup(shard, name);
+        if (r == NULL && (r = room_new(name)) != NULL) {
+                /* Numbering carries on from where the journal got to */
+                if (opts.journal
+                    && (r->jroom = room_numbering(shard, name)) == NULL) {
+                        room_free(r);
+                        r = NULL;
+                } else {
+                        if (r->jroom != NULL)
+                                r->base = r->seq = r->jroom->seq;
+                        r->next = shards[shard].rooms;
+                        shards[shard].rooms = r;
+                }
+        }
+        if (r != NULL)
+                __atomic_add_fetch(&r->users, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shards[shard].mutex);
+        return r;
+}
+
+/*
+ * Find a room's numbering in its shard, adding it at 0 if it has none, or
+ * return NULL if there was no memory. Called with the shard locked.
+ */
+static JRoom *room_numbering(unsigned shard, const char *name) {
+        JRoom *j;
+
+        for (j = shards[shard].numbered; j != NULL; j = j->next)
+                if (!strcmp(j->name, name))
+                        return j;
+        j = calloc(1, sizeof(JRoom));
+        if (j == NULL)
+                return NULL;
+        strncpy(j->name, name, ROOM_NAME_MAX);
+        j->next = shards[shard].numbered;
+        shards[shard].numbered = j;
+        return j;
+}
+
+/* Make an unlinked room, or return NULL if there was no memory */
+static Room *room_new(const char *name) {
+        Room *r;
+
+        r = calloc(1, sizeof(Room) + opts.threads * sizeof(Part));
+        if (r == NULL)
+                return NULL;
+        if (opts.history && (r->history = calloc(opts.history,
+                             sizeof(Msg *))) == NULL) {
+                free(r);
+                return NULL;
+        }
+        strncpy(r->name, name, ROOM_NAME_MAX);
+        r->id = __atomic_fetch_add(&room_ids, 1, __ATOMIC_RELAXED);
+        pthread_mutex_init(&r->mutex, NULL);
+        return r;
+}
+
+/* Find a room by name and take a reference, or return NULL if none */
+Room *room_find(const char *name) {
+        unsigned shard = room_hash(name) % ROOM_SHARDS;
+        Room *r;
+
+        pthread_mutex_lock(&shards[shard].mutex);
+        if ((r = room_lookup(shard, name)) != NULL)
+                __atomic_add_fetch(&r->users, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&shards[shard].mutex);
+        return r;
+}
+
+/*
+ * Take n more references to a room already held. The count cannot reach
+ * zero while the caller's stands, so this needs no shard lock.
+ */
+static Room *room_hold(Room *r, int n) {
+        __atomic_add_fetch(&r->users, n, __ATOMIC_RELAXED);
+        return r;
+}
+
+/* Drop a reference, unlinking and retiring the room with the last one */
+void room_put(Room *r) {
+        unsigned shard = room_hash(r->name) % ROOM_SHARDS;
+        int users = __atomic_load_n(&r->users, __ATOMIC_RELAXED);
+        JRoom **jp;
+        Room **rp;
+
+        /* Only what may be the last reference needs the shard, to unlink */
+        while (users > 1)
+                if (__atomic_compare_exchange_n(&r->users, &users, users - 1,
+                                                0, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_RELAXED))
+                        return;
+        pthread_mutex_lock(&shards[shard].mutex);
+        if (__atomic_sub_fetch(&r->users, 1, __ATOMIC_ACQ_REL)) {
+                pthread_mutex_unlock(&shards[shard].mutex);
+                return;
+        }
+        for (rp = &shards[shard].rooms; *rp != NULL; rp = &(*rp)->next) {
+                if (*rp == r) {
+                        *rp = r->next;
+                        break;
+                }
+        }
+        /* With nobody left to broadcast, the numbering is final */
+        if (r->jroom != NULL && (r->jroom->seq = r->seq) == 0) {
+                for (jp = &shards[shard].numbered; *jp != NULL;
+                     jp = &(*jp)->next) {
+                        if (*jp == r->jroom) {
+                                *jp = r->jroom->next;
+                                free(r->jroom);
+                                break;
+                        }
+                }
+        }
+        pthread_mutex_unlock(&shards[shard].mutex);
+        ebr_retire(r, room_free);
+}
+
+/* Release an unlinked room */
+static void room_free(void *arg) {
+        Room *r = arg;
+        int i;
+
+        pthread_mutex_destroy(&r->mutex);
+        for (i = 0; i < opts.threads; i++) {
+                free(r->part[i].members);
+                free(r->part[i].free);
+        }
+        for (i = 0; i < opts.history && i < r->seq - r->base; i++)
+                msg_put(r->history[(r->base + i) % opts.history]);
+        free(r->history);
+        free(r);
+}
+
+/*
+ * Give part of a room a fresh member array of cap slots, packing the
+ * members at the front, and retire the old one. Called with the room's
+ * mutex held, or before the room is published.
+ */
+static int room_resize(Part *r, int cap) {
+        Members *m, *old = r->members;
+        int *free_slots;
+        int i, n = 0;
+
+        m = calloc(1, sizeof(Members) + cap * sizeof(Node *));
+        free_slots = malloc(cap * sizeof(int));
+        if (m == NULL || free_slots == NULL) {
+                free(m);
+                free(free_slots);
+                return -1;
+        }
+        m->cap = cap;
+        for (i = 0; old != NULL && i < r->len; i++) {
+                if (old->slots[i] == NULL)
+                        continue;
+                old->slots[i]->room_slot = n;
+                m->slots[n++] = old->slots[i];
+        }
+        free(r->free);
+        r->free = free_slots;
+        r->nfree = 0;
+        __atomic_store_n(&r->members, m, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&r->len, n, __ATOMIC_RELEASE);
+        if (old != NULL)
+                ebr_retire(old, free);
+        return 0;
+}
+
+/*
+ * Add a client to a room it holds a reference to, replaying the room's
+ * history since message number since, or all of it for -1. Only the
+ * client's runner moves it between rooms. Returns -1 if there was no
+ * memory, or 1 if the journal is sending what the history no longer
+ * holds first, in which case chat_fetched() finishes the join.
+ */
+int room_join(Node *p, Room *r, long since) {
+        return room_enter(p, r, since, 1);
+}
+
+/* Join as room_join() does, leaving the journal out unless fetch is set */
+static int room_enter(Node *p, Room *r, long since, int fetch) {
+        Part *part = &r->part[p->w->id];
+        unsigned long start;
+        int slot;
+
+        pthread_mutex_lock(&r->mutex);
+        /*
+         * Asked for under the lock, the catch-up is queued behind every
+         * message older than the history, so none escapes both.
+         */
+        start = r->seq - r->base > opts.history ? r->seq - opts.history
+                : r->base;
+        if (fetch && opts.journal && since >= 0 && since < start
+            && journal_fetch(p, r, since, start) == 0) {
+                p->fetch_room = r;
+                p->fetch_until = start;
+                pthread_mutex_unlock(&r->mutex);
+                return 1;
+        }
+        if (part->nfree) {
+                slot = part->free[--part->nfree];
+        } else {
+                if (part->members == NULL
+                    ? room_resize(part, ROOM_MIN) < 0
+                    : part->len == part->members->cap
+                    && room_resize(part, 2 * part->members->cap) < 0) {
+                        pthread_mutex_unlock(&r->mutex);
+                        return -1;
+                }
+                slot = part->len;
+                __atomic_store_n(&part->len, part->len+1, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&part->members->slots[slot], p, __ATOMIC_RELEASE);
+        if (!part->count++)
+                __atomic_or_fetch(&r->busy[p->w->id / 64],
+                                  1UL << (p->w->id % 64), __ATOMIC_SEQ_CST);
+        if (++r->count > FANOUT_MIN)
+                __atomic_store_n(&r->fanout, 1, __ATOMIC_RELEASE);
+        p->room = r;
+        p->room_slot = slot;
+        if (opts.history || opts.journal)
+                room_replay(r, p, since);
+        pthread_mutex_unlock(&r->mutex);
+        return 0;
+}
+
+/*
+ * Queue a joining client what the room's history holds from message
+ * since on, in order, and have delivery skip it for those. The writes
+ * coalesce like any other queued output. Called with r->mutex held,
+ * which keeps out broadcasters recording new messages meanwhile.
+ */
+static void room_replay(Room *r, Node *p, long since) {
+        unsigned long seq;
+
+        seq = r->seq - r->base > opts.history ? r->seq - opts.history
+                : r->base;
+        if (since > 0 && since > seq)
+                seq = since;
+        p->room_seq = r->seq;
+        for (; seq < r->seq; seq++)
+                node_enqueue(p, msg_hold(r->history[seq % opts.history]));
+}
+
+/*
+ * Number a message, keep it in the room's history, evicting the oldest,
+ * and hand it to the journal. Called with r->mutex held.
+ */
+static unsigned long room_record(Room *r, Msg *m) {
+        Msg **slot;
+
+        if (opts.history) {
+                slot = &r->history[r->seq % opts.history];
+                if (r->seq - r->base >= opts.history)
+                        msg_put(*slot);
+                *slot = msg_hold(m);
+        }
+        if (opts.journal)
+                journal_append(r, m, r->seq);
+        __atomic_store_n(&r->seq, r->seq + 1, __ATOMIC_RELAXED);
+        return r->seq - 1;
+}
+
+/*
+ * Take a client out of its room and drop its reference. Broadcasters
+ * still holding the old member array may queue to it once more, which
+ * the closing check in node_enqueue() handles for departed clients.
+ */
+void room_leave(Node *p) {
+        Room *r = p->room;
+        Part *pt;
+        int slot;
+
+        if (r == NULL)
+                return;
+        pt = &r->part[p->w->id];
+        /* Compacting renumbers members, so the slot is only good locked */
+        pthread_mutex_lock(&r->mutex);
+        slot = p->room_slot;
+        __atomic_store_n(&pt->members->slots[slot], NULL, __ATOMIC_RELEASE);
+        if (!--pt->count)
+                __atomic_and_fetch(&r->busy[p->w->id / 64],
+                                   ~(1UL << (p->w->id % 64)), __ATOMIC_SEQ_CST);
+        r->count--;
+        if (slot == pt->len-1)
+                __atomic_store_n(&pt->len, pt->len-1, __ATOMIC_RELEASE);
+        else
+                pt->free[pt->nfree++] = slot;
+        /* Pack sparse rooms so broadcasts don't wade through holes */
+        if (pt->members->cap > ROOM_MIN && pt->count < pt->members->cap / 4)
+                room_resize(pt, pt->members->cap / 2);
+        pthread_mutex_unlock(&r->mutex);
+        p->room = NULL;
+        room_put(r);
+}
+
+/*
+ * Queue message for every member of a room except one. Small rooms are
+ * walked right here; a room that fans out gets one job per worker with
+ * members in it, each holding its own reference to m and the room. Each
+ * worker's jobs run in order, so per-recipient order is kept, and the
+ * switch is one-way so no message can overtake one posted before it.
+ * Returns the number of members that did not take it, counting only the
+ * ones delivered here.
+ */
+int room_broadcast(Room *r, Msg *m, Node *except) {
+        Fanout *f[THREADS_MAX];
+        int to[THREADS_MAX];
+        Worker *w;
+        Metrics *mt = metrics_local();
+        unsigned long seq = 0, bits;
+        int i, j, n = 0, missed = 0;
+
+        metric_add(&mt->broadcasts, 1);
+        if (opts.history || opts.journal) {
+                pthread_mutex_lock(&r->mutex);
+                seq = room_record(r, m);
+                pthread_mutex_unlock(&r->mutex);
+        }
+        ebr_enter();
+        if (!__atomic_load_n(&r->fanout, __ATOMIC_ACQUIRE)) {
+                for (i = 0; i < (opts.threads + 63) / 64; i++)
+                        for (bits = __atomic_load_n(&r->busy[i],
+                                                    __ATOMIC_SEQ_CST);
+                             bits; bits &= bits - 1)
+                                missed += room_deliver(&r->part[i * 64 +
+                                                       __builtin_ctzl(bits)],
+                                                       m, except, seq);
+                ebr_exit();
+                hist_add(&mt->delivery, now_ns() - m->born);
+                return missed;
+        }
+        for (i = 0; i < (opts.threads + 63) / 64; i++) {
+                bits = __atomic_load_n(&r->busy[i], __ATOMIC_SEQ_CST);
+                for (; bits; bits &= bits - 1) {
+                        j = i * 64 + __builtin_ctzl(bits);
+                        f[n] = pool_alloc(sizeof(Fanout));
+                        if (f[n] == NULL) {
+                                /* Out of memory: deliver it ourselves */
+                                missed += room_deliver(&r->part[j], m,
+                                                       except, seq);
+                                continue;
+                        }
+                        f[n]->next = NULL;
+                        f[n]->room = r;
+                        f[n]->m = msg_hold(m);
+                        f[n]->except = except;
+                        f[n]->seq = seq;
+                        to[n++] = j;
+                }
+        }
+        if (n)
+                room_hold(r, n);
+        for (i = 0; i < n; i++) {
+                w = &workers[to[i]];
+                pthread_mutex_lock(&w->mutex);
+                *w->fanout_tail = f[i];
+                w->fanout_tail = &f[i]->next;
+                pthread_mutex_unlock(&w->mutex);
+                worker_wake(w);
+        }
+        ebr_exit();
+        return missed;
+}
+
+/*
+ * Queue message number seq for every member of one part of a room except
+ * one, and those that joined after it was recorded
+ */
+static int room_deliver(Part *part, Msg *m, Node *except,
+                        unsigned long seq) {
+        Members *mem;
+        Node *p;
+        int i, len, missed = 0;
+
+        ebr_enter();
+        mem = __atomic_load_n(&part->members, __ATOMIC_SEQ_CST);
+        len = __atomic_load_n(&part->len, __ATOMIC_ACQUIRE);
+        if (mem == NULL)
+                len = 0;
+        else if (len > mem->cap)
+                len = mem->cap;
+        for (i = 0; i < len; i++) {
+                p = __atomic_load_n(&mem->slots[i], __ATOMIC_ACQUIRE);
+                if (p == NULL || p == except || seq < p->room_seq)
+                        continue;
+                if (node_enqueue(p, msg_hold(m)) < 0)
+                        missed++;
+        }
+        ebr_exit();
+        return missed;
+}
+
+/* Make the journal directory and set up the queue */
+int journal_init(void) {
+        if (mkdir(opts.journal, 0755) < 0 && errno != EEXIST)
+                return -1;
+        pthread_mutex_init(&journal.mutex, NULL);
+        pthread_cond_init(&journal.cond, NULL);
+        journal.head = NULL;
+        journal.tail = &journal.head;
+        journal.len = 0;
+        return 0;
+}
+
+/* Start the thread writing the journal */
+int journal_start(void) {
+        pthread_t th;
+
+        if (pthread_create(&th, NULL, journal_run, NULL))
+                return -1;
+        pthread_detach(th);
+        return 0;
+}
+
+/*
+ * Read where each room's numbering had got to from the files, once before
+ * any room is made: one past the newest message in a segment's index.
+ */
+void journal_scan(void) {
+        char name[ROOM_NAME_MAX+1];
+        unsigned long *firsts, count, next;
+        struct dirent *de;
+        unsigned shard, c;
+        int i, n, len;
+        JRoom *j;
+        DIR *dir;
+
+        dir = opendir(opts.journal);
+        if (dir == NULL) {
+                log_errno(opts.journal);
+                return;
+        }
+        while ((de = readdir(dir)) != NULL) {
+                /* Directories are named by the room's name in hex */
+                len = strlen(de->d_name);
+                if (!len || len % 2 || len > 2 * ROOM_NAME_MAX)
+                        continue;
+                for (i = 0; i < len / 2; i++) {
+                        if (sscanf(de->d_name + 2 * i, "%2x", &c) != 1 || !c)
+                                break;
+                        name[i] = c;
+                }
+                if (i < len / 2)
+                        continue;
+                name[i] = '\0';
+                next = 0;
+                n = journal_segments(name, &firsts);
+                /* Only the newest segment with an index counts */
+                for (i = n - 1; i >= 0; i--) {
+                        if ((count = segment_count(name, firsts[i])) > 0) {
+                                next = firsts[i] + count;
+                                break;
+                        }
+                }
+                if (n > 0)
+                        free(firsts);
+                if (!next)
+                        continue;
+                shard = room_hash(name) % ROOM_SHARDS;
+                pthread_mutex_lock(&shards[shard].mutex);
+                if ((j = room_numbering(shard, name)) == NULL) {
+                        logger_at(LOG_ERROR, "out of memory reading journal");
+                        exit(1);
+                }
+                j->seq = next;
+                pthread_mutex_unlock(&shards[shard].mutex);
+        }
+        closedir(dir);
+}
+
+/*
+ * Queue message number seq of room r for the journal, unless it is too
+ * far behind. Called with r->mutex held, so each room's messages are
+ * queued in order.
+ */
+void journal_append(Room *r, Msg *m, unsigned long seq) {
+        JEntry *e;
+        int wake;
+
+        e = pool_alloc(sizeof(JEntry));
+        pthread_mutex_lock(&journal.mutex);
+        /* A successor taking over the files must find them settled */
+        if (e == NULL || journal.len == JOURNAL_MAX || upgrade.freezing) {
+                journal.lost++;
+                pthread_mutex_unlock(&journal.mutex);
+                pool_free(e, sizeof(JEntry));
+                return;
+        }
+        e->next = NULL;
+        e->m = msg_hold(m);
+        e->p = NULL;
+        e->seq = seq;
+        memcpy(e->room, r->name, sizeof(e->room));
+        wake = (journal.head == NULL);
+        *journal.tail = e;
+        journal.tail = &e->next;
+        journal.len++;
+        pthread_mutex_unlock(&journal.mutex);
+        if (wake)
+                pthread_cond_signal(&journal.cond);
+}
+
+/*
+ * Have the journal thread send a client what it holds of a room from
+ * message since up to until, and hand the client back to its worker.
+ * Called with r->mutex held, so the request is queued behind every
+ * message of the room it can ask for, and it is served once they are
+ * durable. Returns -1 if there was no memory.
+ */
+int journal_fetch(Node *p, Room *r, long since, unsigned long until) {
+        JEntry *e;
+        int wake;
+
+        e = pool_alloc(sizeof(JEntry));
+        if (e == NULL)
+                return -1;
+        e->next = NULL;
+        e->m = NULL;
+        e->p = p;
+        e->seq = since;
+        e->until = until;
+        memcpy(e->room, r->name, sizeof(e->room));
+        /* Until handed back, the node stays ours even if it is closed */
+        pthread_mutex_lock(&p->mutex);
+        p->fetching = 1;
+        pthread_mutex_unlock(&p->mutex);
+        pthread_mutex_lock(&journal.mutex);
+        wake = (journal.head == NULL);
+        *journal.tail = e;
+        journal.tail = &e->next;
+        pthread_mutex_unlock(&journal.mutex);
+        if (wake)
+                pthread_cond_signal(&journal.cond);
+        return 0;
+}
+
+/* Write out and commit whatever was queued, a batch at a time */
+void *journal_run(void *arg) {
+        unsigned long lost, reported = 0, n;
+        JEntry *e, *next;
+        Segment *s;
+
+        while (1) {
+                pthread_mutex_lock(&journal.mutex);
+                while (journal.head == NULL)
+                        pthread_cond_wait(&journal.cond, &journal.mutex);
+                journal.batch = journal.head;
+                journal.head = NULL;
+                journal.tail = &journal.head;
+                journal.len = 0;
+                lost = journal.lost;
+                pthread_mutex_unlock(&journal.mutex);
+
+                for (e = journal.batch, n = 0; e != NULL; e = e->next) {
+                        if (e->m == NULL)
+                                continue;
+                        journal_write(e);
+                        n++;
+                }
+                for (s = journal.segments; s != NULL; s = s->next)
+                        segment_commit(s);
+                /* Catch-ups can read back what was queued ahead of them */
+                for (e = journal.batch; e != NULL; e = e->next)
+                        if (e->p != NULL)
+                                journal_serve(e);
+
+                pthread_mutex_lock(&journal.mutex);
+                e = journal.batch;
+                journal.batch = NULL;
+                pthread_mutex_unlock(&journal.mutex);
+                for (; e != NULL; e = next) {
+                        next = e->next;
+                        if (e->m != NULL)
+                                msg_put(e->m);
+                        pool_free(e, sizeof(JEntry));
+                }
+                __atomic_add_fetch(&journal.written, n, __ATOMIC_RELAXED);
+                if (lost != reported) {
+                        logger_at(LOG_WARN, "journal behind, %lu messages "
+                                  "not kept", lost - reported);
+                        reported = lost;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Send a client what it asked the journal for, and hand it back to its
+ * worker, which finishes the join
+ */
+static void journal_serve(JEntry *e) {
+        Node *p = e->p;
+        Worker *w = p->w;
+
+        p->fetch_upto = journal_replay(p, e->room, e->seq, e->until);
+        pthread_mutex_lock(&w->mutex);
+        p->fetch_next = w->fetched;
+        w->fetched = p;
+        pthread_mutex_unlock(&w->mutex);
+        worker_wake(w);
+}
+
+/*
+ * Append one message to its room's segment, starting a new segment when
+ * the current one is full or the numbering skips.
+ */
+static void journal_write(JEntry *e) {
+        Segment *s, **sp;
+
+        for (sp = &journal.segments; *sp != NULL; sp = &(*sp)->next)
+                if (!strcmp((*sp)->room, e->room))
+                        break;
+        s = *sp;
+        if (s != NULL && (s->off + e->m->len > JOURNAL_SEGMENT
+                          || e->seq != s->first + s->count)) {
+                *sp = s->next;
+                segment_commit(s);
+                segment_close(s);
+                s = NULL;
+        }
+        if (s == NULL) {
+                s = segment_open(e->room, e->seq);
+                if (s == NULL)
+                        return;
+                s->next = journal.segments;
+                journal.segments = s;
+        }
+        if (s->nends == s->cap) {
+                s->cap = s->cap ? 2 * s->cap : 64;
+                s->ends = realloc(s->ends, s->cap * sizeof(uint64_t));
+                if (s->ends == NULL) {
+                        logger_at(LOG_ERROR, "out of memory, journal stopped");
+                        exit(1);
+                }
+        }
+        memcpy(s->map + s->off, e->m->data, e->m->len);
+        s->off += e->m->len;
+        s->ends[s->nends++] = s->off;
+        s->count++;
+}
+
+/*
+ * Format the path of a room's journal directory, or of one of its files
+ * when ext is given. Names come from clients, so they go in hex.
+ */
+static void journal_path(char *buf, int size, const char *room,
+                         unsigned long first, const char *ext) {
+        int n, i;
+
+        n = snprintf(buf, size, "%s/", opts.journal);
+        for (i = 0; room[i] && n < size; i++)
+                n += snprintf(buf + n, size - n, "%02x",
+                              (unsigned char)room[i]);
+        if (ext != NULL && n < size)
+                snprintf(buf + n, size - n, "/%020lu.%s", first, ext);
+}
+
+/* Order sequence numbers for qsort() */
+static int seq_cmp(const void *a, const void *b) {
+        unsigned long x = *(const unsigned long *)a;
+        unsigned long y = *(const unsigned long *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+/*
+ * List the first message numbers of a room's segments, oldest first, in
+ * an array the caller frees. Returns how many, or -1.
+ */
+static int journal_segments(const char *room, unsigned long **firsts) {
+        char path[PATH_MAX], *end;
+        struct dirent *de;
+        unsigned long first, *f = NULL, *grown;
+        int n = 0, cap = 0;
+        DIR *dir;
+
+        journal_path(path, sizeof(path), room, 0, NULL);
+        dir = opendir(path);
+        if (dir == NULL)
+                return errno == ENOENT ? 0 : -1;
+        while ((de = readdir(dir)) != NULL) {
+                first = strtoul(de->d_name, &end, 10);
+                if (end == de->d_name || strcmp(end, ".log"))
+                        continue;
+                if (n == cap) {
+                        cap = cap ? 2 * cap : 16;
+                        grown = realloc(f, cap * sizeof(unsigned long));
+                        if (grown == NULL) {
+                                free(f);
+                                closedir(dir);
+                                return -1;
+                        }
+                        f = grown;
+                }
+                f[n++] = first;
+        }
+        closedir(dir);
+        qsort(f, n, sizeof(unsigned long), seq_cmp);
+        *firsts = f;
+        return n;
+}
+
+/* Return how many of a segment's messages are durable, going by its index */
+static unsigned long segment_count(const char *room, unsigned long first) {
+        char path[PATH_MAX];
+        struct stat st;
+
+        journal_path(path, sizeof(path), room, first, "idx");
+        if (stat(path, &st) < 0)
+                return 0;
+        return st.st_size / sizeof(uint64_t);
+}
+
+/*
+ * Queue a client what the journal holds of a room from message since up
+ * to until: one message per segment, mapping the range straight from the
+ * file, so the bytes go from the page cache to the socket without a copy.
+ * Returns the number after the last message queued, or since if there
+ * were none. Commits wait while this runs on the journal thread, so it
+ * only goes back as far as the newest JOURNAL_REPLAY segments: past the
+ * directory listing, that bounds it to a stat(), two open()s, two
+ * pread()s and an mmap() each.
+ */
+long journal_replay(Node *p, const char *room, long since,
+                    unsigned long until) {
+        unsigned long *firsts, count;
+        char path[PATH_MAX];
+        uint64_t from, to;
+        long page = sysconf(_SC_PAGESIZE);
+        int i, n, fd, idx;
+        off_t base;
+        char *map;
+        Msg *m;
+
+        n = journal_segments(room, &firsts);
+        for (i = n > JOURNAL_REPLAY ? n - JOURNAL_REPLAY : 0; i < n; i++) {
+                if (firsts[i] >= until)
+                        break;
+                count = segment_count(room, firsts[i]);
+                if (count > until - firsts[i])
+                        count = until - firsts[i];
+                if (since >= firsts[i] + count)
+                        continue;
+                if (since < firsts[i])
+                        since = firsts[i];
+                journal_path(path, sizeof(path), room, firsts[i], "idx");
+                idx = open(path, O_RDONLY);
+                journal_path(path, sizeof(path), room, firsts[i], "log");
+                fd = open(path, O_RDONLY);
+                from = 0;
+                if (idx < 0 || fd < 0
+                    || (since > firsts[i]
+                        && pread(idx, &from, sizeof(from), (since - firsts[i]
+                                 - 1) * sizeof(uint64_t)) != sizeof(from))
+                    || pread(idx, &to, sizeof(to), (count - 1)
+                             * sizeof(uint64_t)) != sizeof(to)
+                    || to <= from) {
+                        if (idx >= 0)
+                                close(idx);
+                        if (fd >= 0)
+                                close(fd);
+                        continue;
+                }
+                base = from & ~(uint64_t)(page - 1);
+                map = mmap(NULL, to - base, PROT_READ, MAP_SHARED, fd, base);
+                close(idx);
+                close(fd);
+                if (map == MAP_FAILED) {
+                        log_errno("mmap");
+                        continue;
+                }
+                m = pool_alloc(sizeof(Msg));
+                if (m == NULL) {
+                        munmap(map, to - base);
+                        continue;
+                }
+                m->refs = 1;
+                m->len = to - from;
+                m->born = now_ns();
+                m->data = map + (from - base);
+                m->map_len = to - base;
+                node_enqueue(p, m);
+                since = firsts[i] + count;
+        }
+        if (n > 0)
+                free(firsts);
+        return since;
+}
+
+/* Create a room's segment starting at message first, mapped for writing */
+static Segment *segment_open(const char *room, unsigned long first) {
+        char path[PATH_MAX];
+        Segment *s;
+
+        s = calloc(1, sizeof(Segment));
+        if (s == NULL)
+                return NULL;
+        memcpy(s->room, room, sizeof(s->room));
+        s->first = first;
+        s->fd = s->idx = -1;
+        s->map = MAP_FAILED;
+        journal_path(path, sizeof(path), room, 0, NULL);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST)
+                goto fail;
+        journal_path(path, sizeof(path), room, first, "log");
+        s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (s->fd < 0 || ftruncate(s->fd, JOURNAL_SEGMENT) < 0)
+                goto fail;
+        s->map = mmap(NULL, JOURNAL_SEGMENT, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, s->fd, 0);
+        if (s->map == MAP_FAILED)
+                goto fail;
+        journal_path(path, sizeof(path), room, first, "idx");
+        s->idx = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (s->idx < 0)
+                goto fail;
+        return s;
+fail:
+        log_errno(path);
+        segment_close(s);
+        return NULL;
+}
+
+/*
+ * Make what was written to a segment durable: the data first, then the
+ * index that lets readers see it.
+ */
+static void segment_commit(Segment *s) {
+        size_t start, len;
+        long page = sysconf(_SC_PAGESIZE);
+
+        if (s->nends == 0)
+                return;
+        start = s->synced & ~(size_t)(page - 1);
+        if (msync(s->map + start, s->off - start, MS_SYNC) < 0)
+                log_errno("msync");
+        len = s->nends * sizeof(uint64_t);
+        if (write(s->idx, s->ends, len) != len)
+                log_errno("journal index");
+        else if (fdatasync(s->idx) < 0)
+                log_errno("fdatasync");
+        s->synced = s->off;
+        s->nends = 0;
+}
+
+/* Cut a finished segment down to what it holds and close it */
+static void segment_close(Segment *s) {
+        if (s->map != MAP_FAILED)
+                munmap(s->map, JOURNAL_SEGMENT);
+        if (s->fd >= 0) {
+                if (ftruncate(s->fd, s->off) < 0)
+                        log_errno("ftruncate");
+                close(s->fd);
+        }
+        if (s->idx >= 0)
+                close(s->idx);
+        free(s->ends);
+        free(s);
+}
+
+/*
+ * Queue a message broadcast here for every peer node. Only messages from
+ * our own clients are relayed, never ones relayed to us, so with every
+ * node linked to every other a message reaches each node exactly once.
+ */
+void relay_publish(Room *r, Msg *m) {
+        int n = strlen(r->name), wake;
+        uint32_t len = htonl(m->len);
+        uint64_t one = 1;
+        size_t need = 1 + n + 4 + m->len;
+        char *q;
+
+        pthread_mutex_lock(&relay.mutex);
+        if (relay.qlen + need > RELAY_BUF_MAX) {
+                relay.dropped++;
+                pthread_mutex_unlock(&relay.mutex);
+                return;
+        }
+        if (relay.qlen + need > relay.qcap) {
+                q = realloc(relay.queue, 2 * (relay.qlen + need));
+                if (q == NULL) {
+                        relay.dropped++;
+                        pthread_mutex_unlock(&relay.mutex);
+                        return;
+                }
+                relay.queue = q;
+                relay.qcap = 2 * (relay.qlen + need);
+        }
+        q = relay.queue + relay.qlen;
+        *q++ = n;
+        memcpy(q, r->name, n);
+        memcpy(q + n, &len, 4);
+        memcpy(q + n + 4, m->data, m->len);
+        wake = (relay.qlen == 0);
+        relay.qlen += need;
+        pthread_mutex_unlock(&relay.mutex);
+        if (wake && write(relay.wakefd, &one, sizeof(one)) < 0)
+                log_errno("eventfd write");
+}
+
+/*
+ * Set up the relay: the peers to link to, given as host:port, and the
+ * listener taking their links to us. Returns -1 on a bad peer or if the
+ * relay's descriptors could not be made.
+ */
+int relay_init(int listener, char **peers, int npeers) {
+        struct epoll_event ev;
+        char *colon;
+        int i;
+
+        pthread_mutex_init(&relay.mutex, NULL);
+        relay.listener = listener;
+        relay.id = ((uint64_t)getpid() << 32) ^ now_ns();
+        relay.epfd = epoll_create1(0);
+        relay.wakefd = eventfd(0, EFD_NONBLOCK);
+        if (relay.epfd < 0 || relay.wakefd < 0)
+                return -1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(relay.epfd, EPOLL_CTL_ADD, relay.wakefd, &ev) < 0)
+                return -1;
+        ev.data.ptr = &relay;
+        if (listener >= 0
+            && epoll_ctl(relay.epfd, EPOLL_CTL_ADD, listener, &ev) < 0)
+                return -1;
+        for (i = 0; i < npeers; i++) {
+                colon = strrchr(peers[i], ':');
+                if (colon == NULL)
+                        return -1;
+                *colon = '\0';
+                relay.out[i].host = peers[i];
+                relay.out[i].port = colon + 1;
+                relay.out[i].sock = -1;
+        }
+        relay.nout = npeers;
+        return 0;
+}
+
+/*
+ * Run the links: batch, compress and send what our clients broadcast to
+ * every peer, and hand what peers send us to our own clients. Links to
+ * peers that are down are retried every RELAY_RETRY seconds.
+ */
+void *relay_run(void *arg) {
+        struct epoll_event events[MAX_EVENTS];
+        uint64_t count;
+        Link *l;
+        int i, n;
+
+        if (ebr_register() < 0) {
+                logger_at(LOG_ERROR, "out of reader slots");
+                return NULL;
+        }
+        while (1) {
+                for (i = 0; i < relay.nout; i++)
+                        if (relay.out[i].sock < 0 && !relay.out[i].self
+                            && time(NULL) >= relay.out[i].retry)
+                                link_connect(&relay.out[i]);
+                n = epoll_wait(relay.epfd, events, MAX_EVENTS,
+                               RELAY_RETRY * 1000);
+                if (n < 0 && errno != EINTR) {
+                        log_errno("epoll_wait");
+                        break;
+                }
+                /* Peers' broadcasts reach our clients, so hold them too */
+                if (__atomic_load_n(&upgrade.freezing, __ATOMIC_SEQ_CST))
+                        upgrade_stop();
+                ebr_enter();
+                for (i = 0; i < n; i++) {
+                        l = events[i].data.ptr;
+                        if (l == NULL) {
+                                if (read(relay.wakefd, &count,
+                                         sizeof(count)) < 0
+                                    && errno != EAGAIN)
+                                        log_errno("eventfd read");
+                                relay_flush();
+                        } else if (l == (Link *)&relay) {
+                                link_accept();
+                        } else if (l->host != NULL && !l->connecting
+                                   && events[i].events & (EPOLLIN | EPOLLRDHUP
+                                                          | EPOLLHUP)) {
+                                /* Peers never talk back; this is a close */
+                                link_down(l);
+                        } else if (l->host != NULL) {
+                                link_write(l);
+                        } else {
+                                link_read(l);
+                        }
+                }
+                ebr_exit();
+                ebr_reclaim();
+        }
+        return NULL;
+}
+
+/*
+ * Send everything queued since the last flush to every link that is up,
+ * compressed once per batch of up to RELAY_BATCH bytes of whole records.
+ */
+static void relay_flush(void) {
+        static char *taken, *zbuf;
+        static size_t taken_cap;
+        uLongf zlen;
+        uint32_t hdr[2], mlen;
+        size_t len, off, end, rec, cap;
+        char *q;
+        unsigned long dropped;
+        Link *l;
+        int i;
+
+        if (zbuf == NULL && (zbuf = malloc(sizeof(hdr)
+                                           + compressBound(RELAY_BATCH)))
+            == NULL)
+                return;
+        /* Swap buffers, so broadcasters only wait for the swap */
+        pthread_mutex_lock(&relay.mutex);
+        q = relay.queue;
+        relay.queue = taken;
+        taken = q;
+        cap = relay.qcap;
+        relay.qcap = taken_cap;
+        taken_cap = cap;
+        len = relay.qlen;
+        relay.qlen = 0;
+        dropped = relay.dropped;
+        relay.dropped = 0;
+        pthread_mutex_unlock(&relay.mutex);
+        if (dropped)
+                logger_at(LOG_WARN, "relay behind, %lu messages not sent",
+                          dropped);
+
+        for (off = 0; off < len; off = end) {
+                for (end = off; end < len; end += rec) {
+                        rec = 1 + (unsigned char)taken[end];
+                        memcpy(&mlen, taken + end + rec, 4);
+                        rec += 4 + ntohl(mlen);
+                        if (end > off && end + rec - off > RELAY_BATCH)
+                                break;
+                }
+                /* A batch is an 8 byte header, then the deflated records */
+                zlen = compressBound(RELAY_BATCH);
+                if (compress2((Bytef *)zbuf + sizeof(hdr), &zlen,
+                              (Bytef *)taken + off, end - off, 1) != Z_OK) {
+                        logger_at(LOG_WARN, "relay compression failed");
+                        continue;
+                }
+                hdr[0] = htonl(zlen);
+                hdr[1] = htonl(end - off);
+                memcpy(zbuf, hdr, sizeof(hdr));
+                for (i = 0; i < relay.nout; i++) {
+                        l = &relay.out[i];
+                        if (l->sock >= 0 && !l->connecting
+                            && link_queue(l, zbuf, sizeof(hdr) + zlen) < 0)
+                                logger_at(LOG_WARN, "peer %s:%s behind, "
+                                          "batch dropped", l->host, l->port);
+                }
+        }
+        for (i = 0; i < relay.nout; i++)
+                if (relay.out[i].sock >= 0 && !relay.out[i].connecting)
+                        link_write(&relay.out[i]);
+}
+
+/* Start a non-blocking connect to a peer, introducing ourselves */
+static void link_connect(Link *l) {
+        struct addrinfo *res, hints;
+        struct epoll_event ev;
+        uint64_t id = relay.id;
+
+        l->retry = time(NULL) + RELAY_RETRY;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(l->host, l->port, &hints, &res))
+                return;
+        l->sock = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
+                         res->ai_protocol);
+        if (l->sock >= 0 && connect(l->sock, res->ai_addr, res->ai_addrlen)
+            < 0 && errno != EINPROGRESS) {
+                close(l->sock);
+                l->sock = -1;
+        }
+        freeaddrinfo(res);
+        if (l->sock < 0)
+                return;
+        l->connecting = 1;
+        l->len = l->off = 0;
+        link_queue(l, &id, sizeof(id));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = l;
+        if (epoll_ctl(relay.epfd, EPOLL_CTL_ADD, l->sock, &ev) < 0)
+                link_down(l);
+}
+
+/*
+ * Append bytes to a link's output, unless that would put more than
+ * RELAY_BUF_MAX behind it. Returns -1 if they were dropped.
+ */
+static int link_queue(Link *l, const void *data, size_t len) {
+        char *buf;
+
+        if (l->off == l->len)
+                l->off = l->len = 0;
+        if (l->len - l->off + len > RELAY_BUF_MAX)
+                return -1;
+        if (l->len + len > l->cap) {
+                if (l->off) {
+                        memmove(l->buf, l->buf + l->off, l->len - l->off);
+                        l->len -= l->off;
+                        l->off = 0;
+                }
+                if (l->len + len > l->cap) {
+                        buf = realloc(l->buf, 2 * (l->len + len));
+                        if (buf == NULL)
+                                return -1;
+                        l->buf = buf;
+                        l->cap = 2 * (l->len + len);
+                }
+        }
+        memcpy(l->buf + l->len, data, len);
+        l->len += len;
+        return 0;
+}
+
+/* Write as much of a link's output as the socket takes */
+static void link_write(Link *l) {
+        socklen_t len = sizeof(int);
+        ssize_t n;
+        int err;
+
+        if (l->sock < 0)
+                return;
+        if (l->connecting) {
+                if (getsockopt(l->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0
+                    || err) {
+                        link_down(l);
+                        return;
+                }
+                l->connecting = 0;
+                logger("linked to peer %s:%s", l->host, l->port);
+        }
+        while (l->off < l->len) {
+                n = write(l->sock, l->buf + l->off, l->len - l->off);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                link_down(l);
+                        return;
+                }
+                l->off += n;
+        }
+}
+
+/* Drop a link; ours are retried, peers' are forgotten */
+static void link_down(Link *l) {
+        if (l->host != NULL && !l->connecting && !l->self)
+                logger_at(LOG_WARN, "lost peer %s:%s", l->host, l->port);
+        close(l->sock);
+        l->sock = -1;
+        l->connecting = 0;
+        l->len = l->off = 0;
+        if (l->host == NULL) {
+                free(l->buf);
+                free(l);
+        }
+}
+
+/* Take a peer's link to us */
+static void link_accept(void) {
+        struct epoll_event ev;
+        Link *l;
+        int sock;
+
+        while ((sock = accept4(relay.listener, NULL, NULL, SOCK_NONBLOCK))
+               >= 0) {
+                l = calloc(1, sizeof(Link));
+                if (l == NULL) {
+                        close(sock);
+                        continue;
+                }
+                l->sock = sock;
+                ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+                ev.data.ptr = l;
+                if (epoll_ctl(relay.epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+                        link_down(l);
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_errno("accept");
+}
+
+/*
+ * Read what a peer sent: its node id, then compressed batches of
+ * records. A link from ourselves, or one breaking the format, is dropped.
+ */
+static void link_read(Link *l) {
+        uint32_t zlen, rawlen;
+        uint64_t id;
+        ssize_t n;
+
+        while (1) {
+                if (l->len == l->cap && link_grow(l) < 0) {
+                        link_down(l);
+                        return;
+                }
+                n = read(l->sock, l->buf + l->len, l->cap - l->len);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return;
+                if (n <= 0) {
+                        link_down(l);
+                        return;
+                }
+                l->len += n;
+                if (!l->hello && l->len >= sizeof(id)) {
+                        memcpy(&id, l->buf, sizeof(id));
+                        if (id == relay.id) {
+                                link_self(l);
+                                link_down(l);
+                                return;
+                        }
+                        l->hello = 1;
+                        l->off = sizeof(id);
+                }
+                while (l->hello && l->len - l->off >= 8) {
+                        memcpy(&zlen, l->buf + l->off, 4);
+                        memcpy(&rawlen, l->buf + l->off + 4, 4);
+                        zlen = ntohl(zlen);
+                        rawlen = ntohl(rawlen);
+                        if (zlen > compressBound(RELAY_BATCH)
+                            || rawlen > RELAY_BATCH) {
+                                logger_at(LOG_WARN, "bad batch from peer");
+                                link_down(l);
+                                return;
+                        }
+                        if (l->len - l->off < 8 + zlen)
+                                break;
+                        if (relay_deliver(l->buf + l->off + 8, zlen, rawlen)
+                            < 0) {
+                                logger_at(LOG_WARN, "bad batch from peer");
+                                link_down(l);
+                                return;
+                        }
+                        l->off += 8 + zlen;
+                }
+                memmove(l->buf, l->buf + l->off, l->len - l->off);
+                l->len -= l->off;
+                l->off = 0;
+        }
+}
+
+/*
+ * A link in came from ourselves: find which of our peers that is, by
+ * the address it connected from, and stop linking to it.
+ */
+static void link_self(Link *l) {
+        struct sockaddr_storage from, ours;
+        socklen_t from_len = sizeof(from), ours_len;
+        int i;
+
+        if (getpeername(l->sock, (struct sockaddr *)&from, &from_len) < 0)
+                return;
+        for (i = 0; i < relay.nout; i++) {
+                ours_len = sizeof(ours);
+                if (relay.out[i].sock < 0
+                    || getsockname(relay.out[i].sock,
+                                   (struct sockaddr *)&ours, &ours_len) < 0
+                    || ours_len != from_len || memcmp(&ours, &from, from_len))
+                        continue;
+                logger_at(LOG_WARN, "peer %s:%s is this node, not linking",
+                          relay.out[i].host, relay.out[i].port);
+                relay.out[i].self = 1;
+                link_down(&relay.out[i]);
+                return;
+        }
+}
+
+/* Make room for at least one more batch in an inbound link's buffer */
+static int link_grow(Link *l) {
+        size_t cap = l->cap ? 2 * l->cap : 65536;
+        char *buf;
+
+        if (cap > 2 * compressBound(RELAY_BATCH) + 16)
+                return -1;
+        buf = realloc(l->buf, cap);
+        if (buf == NULL)
+                return -1;
+        l->buf = buf;
+        l->cap = cap;
+        return 0;
+}
+
+/*
+ * Inflate a batch from a peer and broadcast each record to our members
+ * of its room. With the journal on, a room nobody here is in is made for
+ * it, so the record is numbered and kept like one sent here. Otherwise
+ * history is node-local: a room only keeps what arrived while it existed
+ * here, and records for other rooms are dropped. Returns -1 if the batch
+ * is malformed.
+ */
+static int relay_deliver(char *z, uint32_t zlen, uint32_t rawlen) {
+        static char *raw;
+        char name[ROOM_NAME_MAX+1];
+        uLongf len = rawlen;
+        uint32_t mlen;
+        size_t off;
+        Room *r = NULL;
+        Msg *m;
+        int n, ret = 0;
+
+        if (raw == NULL && (raw = malloc(RELAY_BATCH)) == NULL)
+                return 0;
+        if (uncompress((Bytef *)raw, &len, (Bytef *)z, zlen) != Z_OK
+            || len != rawlen)
+                return -1;
+        for (off = 0; off < len; off += n + 4 + mlen) {
+                n = (unsigned char)raw[off++];
+                if (n == 0 || n > ROOM_NAME_MAX || off + n + 4 > len) {
+                        ret = -1;
+                        break;
+                }
+                memcpy(name, raw + off, n);
+                name[n] = '\0';
+                memcpy(&mlen, raw + off + n, 4);
+                mlen = ntohl(mlen);
+                if (off + n + 4 + mlen > len) {
+                        ret = -1;
+                        break;
+                }
+                /* A run of records for one room shares the reference */
+                if (r == NULL || strcmp(r->name, name)) {
+                        if (r != NULL)
+                                room_put(r);
+                        r = opts.journal ? room_get(name) : room_find(name);
+                        if (r == NULL)
+                                continue;
+                }
+                m = msg_new(raw + off + n + 4, mlen);
+                if (m != NULL) {
+                        room_broadcast(r, m, NULL);
+                        msg_put(m);
+                }
+        }
+        if (r != NULL)
+                room_put(r);
+        return ret;
+}
+
+/*
+ * Listen for a successor on opts.upgrade, in place of whatever socket was
+ * there before: a stale one, or our predecessor's, which it is done with.
+ */
+int upgrade_init(void) {
+        struct sockaddr_un sa;
+        struct sigaction act;
+        pthread_t th;
+        int i;
+
+        /* Listeners handed over that we had no use for */
+        for (i = 0; i < HANDOFF_SLOTS; i++)
+                if (upgrade.fds[i] >= 0)
+                        close(upgrade.fds[i]);
+        if (upgrade.sock >= 0)
+                close(upgrade.sock);
+        pthread_mutex_init(&upgrade.mutex, NULL);
+        pthread_cond_init(&upgrade.cond, NULL);
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(opts.upgrade) >= sizeof(sa.sun_path)) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        strcpy(sa.sun_path, opts.upgrade);
+        unlink(opts.upgrade);
+        upgrade.listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (upgrade.listener < 0
+            || bind(upgrade.listener, (struct sockaddr *)&sa, sizeof(sa)) < 0
+            || listen(upgrade.listener, 1) < 0)
+                return -1;
+        /* Without SA_RESTART, so the accept loop's accept() gives up */
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = upgrade_signal;
+        sigaction(SIGUSR1, &act, NULL);
+        upgrade.main = pthread_self();
+        if (pthread_create(&th, NULL, upgrade_run, NULL))
+                return -1;
+        pthread_detach(th);
+        logger("hot restarts through %s", opts.upgrade);
+        return 0;
+}
+
+/* Connect to the upgrade socket of a running server, or return -1 */
+int upgrade_connect(void) {
+        struct sockaddr_un sa;
+        int sock;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strncpy(sa.sun_path, opts.upgrade, sizeof(sa.sun_path)-1);
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+                return -1;
+        if (connect(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+                close(sock);
+                return -1;
+        }
+        logger("taking over from the server on %s", opts.upgrade);
+        return sock;
+}
+
+/* Wait for a successor and hand everything over to it */
+void *upgrade_run(void *arg) {
+        int sock;
+
+        if (ebr_register() < 0) {
+                logger_at(LOG_ERROR, "out of reader slots");
+                return NULL;
+        }
+        while (1) {
+                sock = accept(upgrade.listener, NULL, NULL);
+                if (sock < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        log_errno("accept");
+                        return NULL;
+                }
+                if (opts.engine == ENGINE_URING) {
+                        logger_at(LOG_WARN, "hot restart needs the epoll "
+                                  "engine");
+                        close(sock);
+                        continue;
+                }
+                if (upgrade_handoff(sock) == 0) {
+                        logger("handed over to our successor, exiting");
+                        exit(0);
+                }
+                logger_at(LOG_WARN, "successor went away, carrying on");
+                close(sock);
+        }
+        return NULL;
+}
+
+/* Stand still while a handover is under way */
+void upgrade_stop(void) {
+        pthread_mutex_lock(&upgrade.mutex);
+        upgrade.stopped++;
+        pthread_cond_broadcast(&upgrade.cond);
+        while (upgrade.freezing)
+                pthread_cond_wait(&upgrade.cond, &upgrade.mutex);
+        upgrade.stopped--;
+        pthread_mutex_unlock(&upgrade.mutex);
+}
+
+/* A listener handed over for this slot, or else a new one */
+static int upgrade_listen(int slot, const char *host, const char *port,
+                          int *family) {
+        struct sockaddr_storage sa;
+        socklen_t len = sizeof(sa);
+        int sock = upgrade.fds[slot];
+
+        if (sock < 0)
+                return listen_on(host, port, family);
+        if (getsockname(sock, (struct sockaddr *)&sa, &len) == 0)
+                *family = sa.ss_family;
+        upgrade.fds[slot] = -1;
+        return sock;
+}
+
+/*
+ * Take the listeners our predecessor hands over, into upgrade.fds: a
+ * count, then HANDOFF_BATCH at a time with the slot each one is for.
+ */
+static int upgrade_take(void) {
+        int32_t hdr[2], slots[HANDOFF_BATCH];
+        int fds[HANDOFF_BATCH], i, j, k, n;
+
+        if (upgrade_recv(upgrade.sock, NULL, 0, hdr, sizeof(hdr)) < 0
+            || hdr[0] != HANDOFF_MAGIC || hdr[1] < 0
+            || hdr[1] > HANDOFF_SLOTS)
+                return -1;
+        for (i = 0; i < hdr[1]; i += k) {
+                k = hdr[1] - i < HANDOFF_BATCH ? hdr[1] - i : HANDOFF_BATCH;
+                n = upgrade_recv(upgrade.sock, fds, k, slots,
+                                 k * sizeof(int32_t));
+                if (n < 0)
+                        return -1;
+                for (j = 0; j < n; j++) {
+                        if (j < k && slots[j] >= 0 && slots[j] < HANDOFF_SLOTS
+                            && upgrade.fds[slots[j]] < 0)
+                                upgrade.fds[slots[j]] = fds[j];
+                        else
+                                close(fds[j]);
+                }
+                if (n != k)
+                        return -1;
+        }
+        return 0;
+}
+
+/*
+ * Take on the clients our predecessor hands over, dealing them out to the
+ * workers, which are not yet running. Each goes back to its room and
+ * gets back what it had read and what it had still to be sent.
+ */
+static int upgrade_adopt(void) {
+        HandoffBatch b;
+        Handoff *h;
+        char *buf = NULL;
+        size_t need, cap = 0;
+        int i, n, total = 0;
+        Node *p;
+        Msg *m;
+
+        if (ebr_register() < 0) {
+                logger_at(LOG_ERROR, "out of reader slots");
+                return -1;
+        }
+        while ((n = upgrade_recv(upgrade.sock, b.fds, HANDOFF_BATCH,
+                                 &b.head.n, sizeof(b.head.n))) >= 0) {
+                if (n != b.head.n || n > HANDOFF_BATCH
+                    || upgrade_full(upgrade.sock, b.head.h,
+                                    n * sizeof(Handoff), 0) < 0)
+                        break;
+                if (n == 0) {
+                        free(buf);
+                        logger("took over %d clients", total);
+                        return 0;
+                }
+                for (i = 0; i < n; i++) {
+                        h = &b.head.h[i];
+                        /* A parked client may hold a read of whole ones */
+                        if (h->in_len < 0 || h->in_len > FRAME_HDR + FRAME_MAX
+                            + READ_MAX || h->out_len < 0)
+                                goto fail;
+                        need = h->in_len + h->out_len;
+                        if (need > cap) {
+                                free(buf);
+                                cap = need;
+                                if ((buf = malloc(cap)) == NULL)
+                                        goto fail;
+                        }
+                        if (upgrade_full(upgrade.sock, buf, need, 0) < 0)
+                                goto fail;
+                        p = worker_add(worker_near(opts.pin ?
+                                               sock_cpu(b.fds[i]) : -1, 0),
+                                       b.fds[i]);
+                        total++;
+                        if (p == NULL)
+                                continue;
+                        h->room[ROOM_NAME_MAX] = '\0';
+                        if (h->room[0] && room_move(p, h->room, -1) < 0)
+                                logger_at(LOG_WARN, "out of memory, client "
+                                          "left out of %s", h->room);
+                        /*
+                         * Looked through from the start, as there may be
+                         * whole messages the client will not resend
+                         */
+                        if (h->in_len && in_reserve(p, h->in_len) == 0) {
+                                memcpy(p->in, buf, h->in_len);
+                                p->in_len = h->in_len;
+                                p->in_held = 1;
+                                task_mark(p, EV_READ);
+                                worker_wake(p->w);
+                        }
+                        if (h->out_len
+                            && (m = msg_new(buf + h->in_len, h->out_len))
+                            != NULL)
+                                node_enqueue(p, m);
+                }
+        }
+fail:
+        free(buf);
+        logger_at(LOG_ERROR, "handover from %s broke off", opts.upgrade);
+        return -1;
+}
+
+/*
+ * Stop every thread that handles clients, the relay's and the TLS
+ * handshakes' included, and pass a successor our listeners, then every
+ * client, HANDOFF_BATCH at a time, and an empty batch to end with.
+ * Returns -1 if the successor went away, leaving everything running as
+ * it was.
+ */
+static int upgrade_handoff(int sock) {
+        int expect = opts.threads + !opts.reuseport + upgrade.nhelpers;
+        int32_t hdr[2] = { HANDOFF_MAGIC, 0 }, slots[HANDOFF_SLOTS];
+        int fds[HANDOFF_SLOTS];
+        uint64_t one = 1;
+        struct timespec ts;
+        HandoffBatch b;
+        Table *t;
+        Node *p;
+        Inbox *q;
+        Tls *done;
+        int i, k, n = 0, max, ret = -1;
+        unsigned j;
+
+        pthread_mutex_lock(&upgrade.mutex);
+        __atomic_store_n(&upgrade.freezing, 1, __ATOMIC_SEQ_CST);
+        while (upgrade.stopped < expect) {
+                for (i = 0; i < opts.threads; i++)
+                        worker_wake(&workers[i]);
+                for (i = 0; i < upgrade.nhelpers; i++)
+                        if (write(upgrade.helpers[i], &one, sizeof(one)) < 0)
+                                log_errno("eventfd write");
+                if (!opts.reuseport)
+                        pthread_kill(upgrade.main, SIGUSR1);
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += 10000000;
+                if (ts.tv_nsec >= 1000000000) {
+                        ts.tv_sec++;
+                        ts.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&upgrade.cond, &upgrade.mutex, &ts);
+        }
+        pthread_mutex_unlock(&upgrade.mutex);
+
+        /* Our successor reads the journal back, so let it settle first */
+        for (i = 0; opts.journal != NULL && i < 500; i++) {
+                pthread_mutex_lock(&journal.mutex);
+                max = journal.head == NULL && journal.batch == NULL;
+                pthread_mutex_unlock(&journal.mutex);
+                if (max)
+                        break;
+                usleep(10000);
+        }
+
+        for (i = 0; i < HANDOFF_SLOTS; i++) {
+                if (i < opts.threads)
+                        fds[n] = i == 0 || opts.reuseport
+                                ? workers[i].listener : -1;
+                else if (i >= HANDOFF_ADMIN)
+                        fds[n] = i == HANDOFF_ADMIN ? metrics.listener
+                                : relay.listener;
+                else
+                        continue;
+                if (fds[n] >= 0)
+                        slots[n++] = i;
+        }
+        hdr[1] = n;
+        if (upgrade_send(sock, NULL, 0, hdr, sizeof(hdr)) < 0)
+                goto out;
+        for (i = 0; i < n; i += k) {
+                k = n - i < HANDOFF_BATCH ? n - i : HANDOFF_BATCH;
+                if (upgrade_send(sock, fds + i, k, slots + i,
+                                 k * sizeof(int32_t)) < 0)
+                        goto out;
+        }
+
+        memset(&b, 0, sizeof(b));
+        ebr_enter();
+        t = __atomic_load_n(&list.table, __ATOMIC_SEQ_CST);
+        max = __atomic_load_n(&list.max, __ATOMIC_ACQUIRE);
+        for (i = 0; i < max && i < t->cap; i++) {
+                p = __atomic_load_n(&t->node[i], __ATOMIC_ACQUIRE);
+                if (p != NULL && !p->dead && upgrade_add(&b, p->sock, p, sock)
+                    < 0)
+                        break;
+        }
+        ebr_exit();
+        if (i < max && i < t->cap)
+                goto out;
+        /*
+         * Sockets accepted but not yet taken by a worker, TLS sessions
+         * included; handshakes still under way are lost with us.
+         */
+        for (i = 0; i < opts.threads; i++) {
+                q = &workers[i].inbox;
+                for (j = q->read; j != q->write; j++)
+                        if (upgrade_add(&b, q->sockets[j % opts.inbox], NULL,
+                                        sock) < 0)
+                                goto out;
+                pthread_mutex_lock(&workers[i].mutex);
+                for (done = workers[i].tls; done != NULL; done = done->next)
+                        if (upgrade_add(&b, done->sock, NULL, sock) < 0)
+                                break;
+                pthread_mutex_unlock(&workers[i].mutex);
+                if (done != NULL)
+                        goto out;
+        }
+        if (b.head.n && upgrade_flush(&b, sock) < 0)
+                goto out;
+        ret = upgrade_flush(&b, sock);
+        logger("handed over %lu clients", b.total);
+out:
+        free(b.data);
+        if (ret < 0) {
+                pthread_mutex_lock(&upgrade.mutex);
+                upgrade.freezing = 0;
+                pthread_cond_broadcast(&upgrade.cond);
+                pthread_mutex_unlock(&upgrade.mutex);
+        }
+        return ret;
+}
+
+/*
+ * Add a client to the batch going to our successor, sending the batch
+ * once it is full. Returns -1 if the successor went away.
+ */
+static int upgrade_add(HandoffBatch *b, int sock, Node *p, int out) {
+        Handoff *h = &b->head.h[b->head.n];
+        size_t need;
+        char *data;
+        int i, off;
+        Msg *m;
+
+        memset(h, 0, sizeof(*h));
+        if (p != NULL) {
+                if (p->room != NULL && p->room != lobby)
+                        strcpy(h->room, p->room->name);
+                else if (p->fetch_room != NULL)
+                        strcpy(h->room, p->fetch_room->name);
+                h->in_len = p->in_len;
+                pthread_mutex_lock(&p->mutex);
+                need = p->in_len;
+                for (i = p->out_read; i != p->out_write; i = (i+1) % p->out_cap)
+                        need += p->out[i]->len;
+                if (b->len + need > b->cap) {
+                        data = realloc(b->data, 2 * (b->len + need));
+                        if (data == NULL) {
+                                pthread_mutex_unlock(&p->mutex);
+                                return -1;
+                        }
+                        b->data = data;
+                        b->cap = 2 * (b->len + need);
+                }
+                if (p->in_len)
+                        memcpy(b->data + b->len, p->in, p->in_len);
+                b->len += p->in_len;
+                for (i = p->out_read, off = p->out_off; i != p->out_write;
+                     i = (i+1) % p->out_cap, off = 0) {
+                        m = p->out[i];
+                        memcpy(b->data + b->len, m->data + off, m->len - off);
+                        b->len += m->len - off;
+                        h->out_len += m->len - off;
+                }
+                pthread_mutex_unlock(&p->mutex);
+        }
+        b->fds[b->head.n++] = sock;
+        b->total++;
+        if (b->head.n == HANDOFF_BATCH)
+                return upgrade_flush(b, out);
+        return 0;
+}
+
+/* Send a batch of clients: their descriptors and records, then the bytes */
+static int upgrade_flush(HandoffBatch *b, int out) {
+        int n = b->head.n;
+
+        if (upgrade_send(out, b->fds, n, &b->head,
+                         sizeof(b->head.n) + n * sizeof(Handoff)) < 0
+            || upgrade_full(out, b->data, b->len, 1) < 0)
+                return -1;
+        b->head.n = 0;
+        b->len = 0;
+        return 0;
+}
+
+/* Send len bytes with n descriptors attached to them */
+static int upgrade_send(int sock, int *fds, int n, void *buf, size_t len) {
+        union {
+                char buf[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+                struct cmsghdr align;
+        } ctl;
+        struct iovec iov = { buf, len };
+        struct msghdr msg;
+        struct cmsghdr *c;
+        ssize_t sent;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (n) {
+                msg.msg_control = ctl.buf;
+                msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+                c = CMSG_FIRSTHDR(&msg);
+                c->cmsg_level = SOL_SOCKET;
+                c->cmsg_type = SCM_RIGHTS;
+                c->cmsg_len = CMSG_LEN(n * sizeof(int));
+                memcpy(CMSG_DATA(c), fds, n * sizeof(int));
+        }
+        do
+                sent = sendmsg(sock, &msg, 0);
+        while (sent < 0 && errno == EINTR);
+        if (sent < 0)
+                return -1;
+        return upgrade_full(sock, (char *)buf + sent, len - sent, 1);
+}
+
+/*
+ * Read exactly len bytes, and up to max descriptors sent with them.
+ * Returns how many descriptors came, or -1.
+ */
+static int upgrade_recv(int sock, int *fds, int max, void *buf, size_t len) {
+        union {
+                char buf[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+                struct cmsghdr align;
+        } ctl;
+        struct iovec iov = { buf, len };
+        struct msghdr msg;
+        struct cmsghdr *c;
+        ssize_t got;
+        int n = 0;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        do
+                got = recvmsg(sock, &msg, 0);
+        while (got < 0 && errno == EINTR);
+        if (got <= 0 || (msg.msg_flags & MSG_CTRUNC))
+                return -1;
+        for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+                if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+                        continue;
+                n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                if (n > max)
+                        return -1;
+                memcpy(fds, CMSG_DATA(c), n * sizeof(int));
+        }
+        if (upgrade_full(sock, (char *)buf + got, len - got, 0) < 0)
+                return -1;
+        return n;
+}
+
+/* Read or write all of len bytes on a blocking socket */
+static int upgrade_full(int sock, void *buf, size_t len, int out) {
+        ssize_t n;
+
+        while (len) {
+                n = out ? write(sock, buf, len) : read(sock, buf, len);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return -1;
+                buf = (char *)buf + n;
+                len -= n;
+        }
+        return 0;
+}
+
+/* SIGUSR1 only has to interrupt a system call */
+static void upgrade_signal(int sig) {
+}
+
+/*
+ * Set up serving TLS from opts.tls_cert: the context, and the epoll
+ * instance the handshake thread waits on. Only what the kernel can take
+ * over is offered; OpenSSL before 3.2 can only offload TLS 1.3 for
+ * sending, so there it stops at TLS 1.2. Returns -1 if the certificate
+ * or key won't load, or if this kernel has no TLS to hand sessions to.
+ */
+int tls_init(void) {
+        const char *key = opts.tls_key ? opts.tls_key : opts.tls_cert;
+        struct epoll_event ev;
+        int sock, ulp;
+
+        /* Only a module that is missing fails on an unconnected socket */
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0)
+                return -1;
+        ulp = setsockopt(sock, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+        if (ulp < 0 && errno == ENOENT) {
+                logger_at(LOG_ERROR, "kernel TLS is not available, "
+                          "is the tls module loaded?");
+                close(sock);
+                return -1;
+        }
+        close(sock);
+
+        tls.ctx = SSL_CTX_new(TLS_server_method());
+        if (tls.ctx == NULL)
+                goto fail;
+        SSL_CTX_set_min_proto_version(tls.ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+        SSL_CTX_set_max_proto_version(tls.ctx, TLS1_2_VERSION);
+#endif
+        SSL_CTX_set_options(tls.ctx, SSL_OP_ENABLE_KTLS
+                            | SSL_OP_NO_RENEGOTIATION);
+        /* Sessions leave OpenSSL, so there is nothing to resume */
+        SSL_CTX_set_session_cache_mode(tls.ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_num_tickets(tls.ctx, 0);
+        if (!SSL_CTX_set_cipher_list(tls.ctx,
+                                     "ECDHE+AESGCM:ECDHE+CHACHA20")
+            || !SSL_CTX_use_certificate_chain_file(tls.ctx, opts.tls_cert)
+            || !SSL_CTX_use_PrivateKey_file(tls.ctx, key, SSL_FILETYPE_PEM)
+            || !SSL_CTX_check_private_key(tls.ctx))
+                goto fail;
+
+        pthread_mutex_init(&tls.mutex, NULL);
+        tls.epfd = epoll_create1(0);
+        tls.wakefd = eventfd(0, EFD_NONBLOCK);
+        if (tls.epfd < 0 || tls.wakefd < 0)
+                return -1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(tls.epfd, EPOLL_CTL_ADD, tls.wakefd, &ev) < 0)
+                return -1;
+        logger("serving TLS with %s", opts.tls_cert);
+        return 0;
+fail:
+        logger_at(LOG_ERROR, "TLS: %s",
+                  ERR_reason_error_string(ERR_get_error()));
+        return -1;
+}
+
+/* Run handshakes as their sockets become ready, dropping stale ones */
+void *tls_run(void *arg) {
+        struct epoll_event events[MAX_EVENTS];
+        unsigned long now;
+        uint64_t count;
+        Tls *t, *next;
+        int i, n;
+
+        while (1) {
+                n = epoll_wait(tls.epfd, events, MAX_EVENTS, 1000);
+                if (n < 0 && errno != EINTR) {
+                        log_errno("epoll_wait");
+                        break;
+                }
+                /* Finished handshakes go to workers, so hold them too */
+                if (__atomic_load_n(&upgrade.freezing, __ATOMIC_SEQ_CST))
+                        upgrade_stop();
+                for (i = 0; i < n; i++) {
+                        t = events[i].data.ptr;
+                        if (t != NULL) {
+                                tls_step(t);
+                                continue;
+                        }
+                        if (read(tls.wakefd, &count, sizeof(count)) < 0
+                            && errno != EAGAIN)
+                                log_errno("eventfd read");
+                        pthread_mutex_lock(&tls.mutex);
+                        t = tls.incoming;
+                        tls.incoming = NULL;
+                        pthread_mutex_unlock(&tls.mutex);
+                        for (; t != NULL; t = next) {
+                                next = t->next;
+                                t->next = NULL;
+                                t->prev = tls.tail;
+                                if (tls.tail != NULL)
+                                        tls.tail->next = t;
+                                else
+                                        tls.head = t;
+                                tls.tail = t;
+                                tls_step(t);
+                        }
+                }
+                now = now_ns();
+                while (tls.head != NULL && tls.head->deadline <= now)
+                        tls_drop(tls.head, "handshake timed out");
+        }
+        return NULL;
+}
+
+/*
+ * Pass a client freshly accepted on a TLS listener to the handshake
+ * thread. It goes back to home when done, or to any worker if NULL.
+ */
+static void tls_add(int sock, Worker *home) {
+        uint64_t one = 1;
+        Tls *t;
+
+        t = calloc(1, sizeof(Tls));
+        if (t == NULL || set_nonblock(sock) < 0
+            || (t->ssl = SSL_new(tls.ctx)) == NULL
+            || !SSL_set_fd(t->ssl, sock)) {
+                logger_at(LOG_WARN, "out of memory, dropping TLS client");
+                metric_add(&metrics_local()->rejects, 1);
+                if (t != NULL)
+                        SSL_free(t->ssl);
+                free(t);
+                close(sock);
+                return;
+        }
+        SSL_set_accept_state(t->ssl);
+        t->sock = sock;
+        t->home = home;
+        t->deadline = now_ns() + TLS_TIMEOUT * 1000000000UL;
+        pthread_mutex_lock(&tls.mutex);
+        t->next = tls.incoming;
+        tls.incoming = t;
+        pthread_mutex_unlock(&tls.mutex);
+        if (write(tls.wakefd, &one, sizeof(one)) != sizeof(one))
+                log_errno("eventfd write");
+}
+
+/* Take a handshake as far as it goes, then wait for what it needs next */
+static void tls_step(Tls *t) {
+        struct epoll_event ev;
+        int ret, err;
+
+        ret = SSL_do_handshake(t->ssl);
+        if (ret == 1) {
+                tls_done(t);
+                return;
+        }
+        err = SSL_get_error(t->ssl, ret);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+                tls_drop(t, err == SSL_ERROR_SSL
+                         ? ERR_reason_error_string(ERR_peek_error())
+                         : "connection lost");
+                return;
+        }
+        ev.events = EPOLLONESHOT
+                | (err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT);
+        ev.data.ptr = t;
+        if (epoll_ctl(tls.epfd, t->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                      t->sock, &ev) < 0) {
+                tls_drop(t, strerror(errno));
+                return;
+        }
+        t->armed = 1;
+}
+
+/*
+ * A handshake is done: if the kernel has both directions of the session,
+ * let OpenSSL go and give the socket to a worker, else drop it.
+ */
+static void tls_done(Tls *t) {
+        Worker *w;
+
+        if (!BIO_get_ktls_send(SSL_get_wbio(t->ssl))
+            || !BIO_get_ktls_recv(SSL_get_rbio(t->ssl))) {
+                tls_drop(t, "session not offloaded to the kernel");
+                return;
+        }
+        if (t->armed)
+                epoll_ctl(tls.epfd, EPOLL_CTL_DEL, t->sock, NULL);
+        tls_unlink(t);
+        logger_at(LOG_DEBUG, "TLS session using %s",
+                  SSL_get_cipher_name(t->ssl));
+        /* The socket stays open; the kernel has the keys now */
+        SSL_free(t->ssl);
+        t->ssl = NULL;
+        metric_add(&metrics_local()->handshakes, 1);
+        w = t->home;
+        if (w == NULL)
+                w = &workers[tls.next++ % opts.threads];
+        pthread_mutex_lock(&w->mutex);
+        t->next = w->tls;
+        w->tls = t;
+        pthread_mutex_unlock(&w->mutex);
+        worker_wake(w);
+}
+
+/* Give up on a handshake and close its client */
+static void tls_drop(Tls *t, const char *why) {
+        logger("TLS handshake failed: %s", why ? why : "unknown error");
+        ERR_clear_error();
+        metric_add(&metrics_local()->tls_failures, 1);
+        tls_unlink(t);
+        SSL_free(t->ssl);
+        close(t->sock);
+        free(t);
+}
+
+/* Take a handshake off the thread's list */
+static void tls_unlink(Tls *t) {
+        if (t->prev != NULL)
+                t->prev->next = t->next;
+        else
+                tls.head = t->next;
+        if (t->next != NULL)
+                t->next->prev = t->prev;
+        else
+                tls.tail = t->prev;
+}
+
+/* Take on the clients whose sessions the TLS thread has handed us */
+static void tls_take(Worker *w) {
+        Tls *t, *next;
+
+        pthread_mutex_lock(&w->mutex);
+        t = w->tls;
+        w->tls = NULL;
+        pthread_mutex_unlock(&w->mutex);
+        for (; t != NULL; t = next) {
+                next = t->next;
+                worker_add(w, t->sock);
+                free(t);
+        }
+}
+
+/* Size the pools; the node pool holds exactly one client each */
+void pool_init(void) {
+        int i, j;
+
+        for (i = 0; i < POOL_COUNT; i++) {
+                pools[i].size = i == POOL_NODE ? sizeof(Node) : 64 << i;
+                for (j = 0; j < NODES_MAX; j++)
+                        pthread_mutex_init(&pools[i].depots[j].mutex, NULL);
+        }
+        pthread_mutex_init(&pool.mutex, NULL);
+}
+
+/* Return the smallest class holding size bytes, or -1 if none does */
+static int pool_class(int size) {
+        int i;
+
+        for (i = 0; i < POOL_CLASSES; i++)
+                if (size <= 64 << i)
+                        return i;
+        return -1;
+}
+
+/* Take an object from a pool, or NULL once memory runs out */
+void *pool_get(int id) {
+        Cache *c = pool_caches();
+        void *obj;
+
+        if (c == NULL)
+                return NULL;
+        c += id;
+        if (c->head == NULL && pool_refill(id) < 0)
+                return NULL;
+        obj = c->head;
+        c->head = *(void **)obj;
+        c->len--;
+        return obj;
+}
+
+/* Give an object back, to this thread's cache whoever took it */
+void pool_put(int id, void *obj) {
+        Cache *c = pool_caches();
+        Depot *d = &pools[id].depots[pool_node];
+        void *batch, **tail;
+        int i;
+
+        if (c == NULL) {
+                /* No cache to spare: straight to the depot */
+                pthread_mutex_lock(&d->mutex);
+                *(void **)obj = d->head;
+                d->head = obj;
+                d->len++;
+                pthread_mutex_unlock(&d->mutex);
+                return;
+        }
+        c += id;
+        *(void **)obj = c->head;
+        c->head = obj;
+        if (++c->len <= CACHE_MAX)
+                return;
+        /* Hand a batch back so objects freed here can be used elsewhere */
+        batch = c->head;
+        for (tail = &c->head, i = 0; i < CACHE_BATCH; i++)
+                tail = (void **)*tail;
+        c->head = *tail;
+        c->len -= CACHE_BATCH;
+        pthread_mutex_lock(&d->mutex);
+        *tail = d->head;
+        d->head = batch;
+        d->len += CACHE_BATCH;
+        pthread_mutex_unlock(&d->mutex);
+}
+
+/*
+ * Fill this thread's empty cache for a pool from its node's depot,
+ * carving a new slab if the depot is empty too. Returns -1 if that would
+ * pass opts.mem_max or mapping the slab fails.
+ */
+static int pool_refill(int id) {
+        Cache *c = pool_caches() + id;
+        Pool *pl = &pools[id];
+        Depot *d = &pl->depots[pool_node];
+        char *slab;
+        void *obj;
+        int i, n;
+
+        pthread_mutex_lock(&d->mutex);
+        for (i = 0; i < CACHE_BATCH && d->head != NULL; i++) {
+                obj = d->head;
+                d->head = *(void **)obj;
+                *(void **)obj = c->head;
+                c->head = obj;
+        }
+        d->len -= i;
+        c->len += i;
+        if (i) {
+                pthread_mutex_unlock(&d->mutex);
+                return 0;
+        }
+        n = SLAB_SIZE / pl->size;
+        if (n < 1)
+                n = 1;
+        if (opts.mem_max && __atomic_load_n(&pool.bytes, __ATOMIC_RELAXED)
+            + (unsigned long)n * pl->size > opts.mem_max) {
+                pthread_mutex_unlock(&d->mutex);
+                return -1;
+        }
+        slab = pool_slab((size_t)n * pl->size);
+        if (slab == NULL) {
+                pthread_mutex_unlock(&d->mutex);
+                return -1;
+        }
+        d->objects += n;
+        __atomic_add_fetch(&pool.bytes, (unsigned long)n * pl->size,
+                           __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&d->mutex);
+        for (i = 0; i < n; i++) {
+                *(void **)(slab + i * pl->size) = c->head;
+                c->head = slab + i * pl->size;
+        }
+        c->len += n;
+        return 0;
+}
+
+/*
+ * Map len bytes for a slab, on this thread's node. The pages are only
+ * placed when first touched, which is mostly by this thread anyway, but
+ * a preference makes sure of it.
+ */
+static void *pool_slab(size_t len) {
+        unsigned long mask = 1UL << pool_node;
+        void *slab;
+
+        slab = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+                return NULL;
+        if (topo.nnodes > 1 && syscall(SYS_mbind, slab, len, MPOL_PREFERRED,
+                                       &mask, NODES_MAX + 1, 0) < 0)
+                log_errno("mbind");
+        return slab;
+}
+
+/* This thread's caches, set up and registered on first use */
+static Cache *pool_caches(void) {
+        int cpu;
+
+        if (pool_cache != NULL)
+                return pool_cache;
+        /* Workers are pinned by now, if they are going to be */
+        cpu = sched_getcpu();
+        if (cpu >= 0 && cpu < CPU_SETSIZE && topo.node[cpu] < NODES_MAX)
+                pool_node = topo.node[cpu];
+        pthread_mutex_lock(&pool.mutex);
+        if (pool.ncaches < EBR_SLOTS) {
+                pool_cache = calloc(POOL_COUNT, sizeof(Cache));
+                if (pool_cache != NULL)
+                        pool.caches[pool.ncaches++] = pool_cache;
+        }
+        pthread_mutex_unlock(&pool.mutex);
+        return pool_cache;
+}
+
+/* Allocate size bytes from the smallest class that fits, else malloc() */
+void *pool_alloc(int size) {
+        int cls = pool_class(size);
+
+        return cls < 0 ? malloc(size) : pool_get(cls);
+}
+
+/* Free what pool_alloc() returned for the same size */
+void pool_free(void *obj, int size) {
+        int cls = pool_class(size);
+
+        if (obj == NULL)
+                return;
+        if (cls < 0)
+                free(obj);
+        else
+                pool_put(cls, obj);
+}
+
+/* Start the global epoch at 1 so a zero slot always means idle */
+void ebr_init(void) {
+        ebr.epoch = 1;
+        ebr.nslots = 0;
+        ebr.limbo = NULL;
+        pthread_mutex_init(&ebr.mutex, NULL);
+}
+
+/* Give the calling thread a reader slot. Returns -1 if none are left. */
+int ebr_register(void) {
+        pthread_mutex_lock(&ebr.mutex);
+        if (ebr.nslots < EBR_SLOTS)
+                ebr_slot = ebr.nslots++;
+        pthread_mutex_unlock(&ebr.mutex);
+        return ebr_slot;
+}
+
+/* Begin a read section; published objects seen inside it stay valid */
+void ebr_enter(void) {
+        unsigned long e;
+
+        if (ebr_depth++)
+                return;
+        e = __atomic_load_n(&ebr.epoch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&ebr.active[ebr_slot], e, __ATOMIC_SEQ_CST);
+}
+
+/* End a read section */
+void ebr_exit(void) {
+        if (--ebr_depth)
+                return;
+        __atomic_store_n(&ebr.active[ebr_slot], 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Hand over an object that has already been unpublished. Bumping the
+ * epoch afterwards means any reader that enters later cannot find it.
+ */
+void ebr_retire(void *ptr, void (*release)(void *)) {
+        Retired *r;
+
+        r = pool_alloc(sizeof(Retired));
+        if (r == NULL) {
+                logger_at(LOG_WARN, "out of memory, leaking retired object");
+                return;
+        }
+        r->ptr = ptr;
+        r->release = release;
+        r->epoch = __atomic_fetch_add(&ebr.epoch, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_lock(&ebr.mutex);
+        r->next = ebr.limbo;
+        ebr.limbo = r;
+        pthread_mutex_unlock(&ebr.mutex);
+}
+
+/* Release every retired object that no reader can still be using */
+void ebr_reclaim(void) {
+        Retired *r, **rp, *done = NULL;
+        unsigned long e, min = (unsigned long)-1;
+        int i;
+
+        pthread_mutex_lock(&ebr.mutex);
+        for (i = 0; i < ebr.nslots; i++) {
+                e = __atomic_load_n(&ebr.active[i], __ATOMIC_SEQ_CST);
+                if (e && e < min)
+                        min = e;
+        }
+        for (rp = &ebr.limbo; (r = *rp) != NULL; ) {
+                if (r->epoch < min) {
+                        *rp = r->next;
+                        r->next = done;
+                        done = r;
+                } else {
+                        rp = &r->next;
+                }
+        }
+        pthread_mutex_unlock(&ebr.mutex);
+        for (; done != NULL; done = r) {
+                r = done->next;
+                done->release(done->ptr);
+                pool_free(done, sizeof(Retired));
+        }
+}
+
+/* Copy len bytes of buf into a new message holding one reference */
+Msg *msg_new(char *buf, int len) {
+        Msg *m;
+
+        m = pool_alloc(sizeof(Msg) + len);
+        if (m == NULL)
+                return NULL;
+        m->refs = 1;
+        m->len = len;
+        m->born = now_ns();
+        m->data = m->buf;
+        m->map_len = 0;
+        memcpy(m->data, buf, len);
+        return m;
+}
+
+/* Wrap len bytes of buf in a frame of the given type */
+Msg *msg_frame(int type, char *buf, int len) {
+        uint32_t n = htonl(len);
+        Msg *m;
+
+        m = pool_alloc(sizeof(Msg) + FRAME_HDR + len);
+        if (m == NULL)
+                return NULL;
+        m->refs = 1;
+        m->len = FRAME_HDR + len;
+        m->born = now_ns();
+        m->data = m->buf;
+        m->map_len = 0;
+        memcpy(m->data, &n, 4);
+        m->data[4] = type;
+        memcpy(m->data + FRAME_HDR, buf, len);
+        return m;
+}
+
+/* Take another reference to a message */
+Msg *msg_hold(Msg *m) {
+        __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+        return m;
+}
+
+/* Drop a reference, freeing the message with the last one */
+void msg_put(Msg *m) {
+        if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL))
+                return;
+        if (m->map_len) {
+                munmap((void *)((uintptr_t)m->data & ~(uintptr_t)
+                                (sysconf(_SC_PAGESIZE) - 1)), m->map_len);
+                pool_free(m, sizeof(Msg));
+                return;
+        }
+        pool_free(m, sizeof(Msg) + m->len);
+}
+
+/* Return the number of messages queued for a client */
+static int out_size(Node *p) {
+        if (p->out_cap == 0)
+                return 0;
+        return (p->out_cap - p->out_read + p->out_write)%p->out_cap;
+}
+
+/*
+ * Double a client's send ring, or make its first one, moving what is
+ * queued to the front. Called with p->mutex held. Returns -1 if there
+ * was no memory.
+ */
+static int out_grow(Node *p) {
+        int cap, n = out_size(p), i;
+        Msg **out;
+
+        cap = p->out_cap ? 2 * p->out_cap : OUT_MIN;
+        if (cap > opts.out_max+1)
+                cap = opts.out_max+1;
+        out = pool_alloc(cap * sizeof(Msg *));
+        if (out == NULL)
+                return -1;
+        for (i = 0; i < n; i++)
+                out[i] = p->out[(p->out_read+i)%p->out_cap];
+        pool_free(p->out, p->out_cap * sizeof(Msg *));
+        node_account(p, (long)(cap - p->out_cap) * sizeof(Msg *));
+        p->out = out;
+        p->out_cap = cap;
+        p->out_read = 0;
+        p->out_write = n;
+        return 0;
+}
+
+/*
+ * In compact mode, let go of a drained send ring. Called with p->mutex
+ * held.
+ */
+static void out_trim(Node *p) {
+        if (!opts.compact || p->out == NULL || out_size(p) || p->out_busy)
+                return;
+        pool_free(p->out, p->out_cap * sizeof(Msg *));
+        node_account(p, -(long)p->out_cap * sizeof(Msg *));
+        p->out = NULL;
+        p->out_cap = 0;
+        p->out_read = p->out_write = 0;
+}
+
+/* Count bytes held for a client against its worker */
+static void node_account(Node *p, long bytes) {
+        __atomic_add_fetch(&p->w->client_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * Queue a message for a client, applying the overflow policy when its
+ * queue is full. Takes over the caller's reference to m. Returns -1 if
+ * it was not queued.
+ */
+int node_enqueue(Node *p, Msg *m) {
+        Metrics *mt = metrics_local();
+        int i, pin, pos, slots;
+
+        pthread_mutex_lock(&p->mutex);
+        if (p->closing)
+                goto drop;
+        /* Rings start small and grow until they hold opts.out_max */
+        if (out_size(p) < opts.out_max && out_size(p) + 1 >= p->out_cap
+            && out_grow(p) < 0)
+                goto drop;
+        slots = p->out_cap;
+        if (out_size(p) == opts.out_max) {
+                switch (opts.overflow) {
+                case DROP_NEWEST:
+                        goto drop;
+                case DISCONNECT:
+                        p->closing = 1;
+                        node_schedule(p);
+                        metric_add(&mt->kicks, 1);
+                        goto drop;
+                case DROP_OLDEST:
+                        /*
+                         * Never cut into messages being written: drop the
+                         * oldest one behind them and shift them up a slot.
+                         */
+                        pin = p->out_busy;
+                        if (!pin && p->out_off)
+                                pin = 1;
+                        if (pin == opts.out_max)
+                                goto drop;
+                        pos = (p->out_read+pin)%slots;
+                        msg_put(p->out[pos]);
+                        for (i = pin; i > 0; i--) {
+                                p->out[pos] = p->out[(pos+slots-1)%slots];
+                                pos = (pos+slots-1)%slots;
+                        }
+                        p->out_read = (p->out_read+1)%slots;
+                        break;
+                }
+        }
+        /* Output waiting on an empty queue starts the write timeout */
+        if (opts.stall && !out_size(p))
+                p->progress = now_ns();
+        p->out[p->out_write] = m;
+        p->out_write = (p->out_write+1)%slots;
+        hist_add(&mt->depth, out_size(p));
+        node_schedule(p);
+        pthread_mutex_unlock(&p->mutex);
+        metric_add(&mt->queued, 1);
+        return 0;
+drop:
+        pthread_mutex_unlock(&p->mutex);
+        msg_put(m);
+        metric_add(&mt->dropped, 1);
+        return -1;
+}
+
+/* Put a client on its worker's pending list. Called with p->mutex held. */
+static void node_schedule(Node *p) {
+        Worker *w = p->w;
+        int idle;
+
+        if (p->pending)
+                return;
+        p->pending = 1;
+        pthread_mutex_lock(&w->mutex);
+        idle = (w->pending == NULL);
+        p->pnext = w->pending;
+        w->pending = p;
+        pthread_mutex_unlock(&w->mutex);
+        if (idle)
+                worker_wake(w);
+}
+
+/*
+ * Write out as much of a client's queue as the socket will take, up to
+ * FLUSH_IOV messages per writev() so a burst costs one syscall. Whichever
+ * worker runs the client calls this, its owner or one that stole it;
+ * holding p->mutex throughout keeps flushes from overlapping. Returns -1
+ * if the client should be closed.
+ */
+int node_flush(Node *p) {
+        struct iovec iov[FLUSH_IOV];
+        int slots = p->out_cap;
+        int i, n, cnt, pos, cork, off = 0;
+        ssize_t sent;
+        Msg *m;
+
+        pthread_mutex_lock(&p->mutex);
+        /* A backlog takes more than one writev(): send it in full segments */
+        cork = opts.tune.cork && out_size(p) > FLUSH_IOV;
+        if (cork && setsockopt(p->sock, IPPROTO_TCP, TCP_CORK, &cork,
+                               sizeof(cork)) < 0)
+                cork = 0;
+        while ((cnt = out_size(p)) > 0 && !p->closing) {
+                if (cnt > FLUSH_IOV)
+                        cnt = FLUSH_IOV;
+                for (i = 0, pos = p->out_read; i < cnt; i++) {
+                        m = p->out[pos];
+                        iov[i].iov_base = m->data;
+                        iov[i].iov_len = m->len;
+                        pos = (pos+1)%slots;
+                }
+                iov[0].iov_base = (char *)iov[0].iov_base + p->out_off;
+                iov[0].iov_len -= p->out_off;
+                sent = writev(p->sock, iov, cnt);
+                if (sent < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                break;
+                        log_errno("writev");
+                        p->closing = 1;
+                        break;
+                }
+                metric_add(&metrics_local()->bytes_out, sent);
+                if (opts.stall && sent > 0)
+                        p->progress = now_ns();
+                /* Release every message that went out in full */
+                for (i = 0; i < cnt && sent >= iov[i].iov_len; i++) {
+                        sent -= iov[i].iov_len;
+                        msg_put(p->out[p->out_read]);
+                        p->out_off = 0;
+                        p->out_read = (p->out_read+1)%slots;
+                }
+                if (i < cnt) {
+                        p->out_off += sent;
+                        break;
+                }
+        }
+        if (cork)
+                setsockopt(p->sock, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        out_trim(p);
+        n = p->closing ? -1 : 0;
+        pthread_mutex_unlock(&p->mutex);
+        return n;
+}
+
+/* Release a client's queued output and the node itself */
+static void node_free(void *arg) {
+        Node *p = arg;
+
+        while (out_size(p)) {
+                msg_put(p->out[p->out_read]);
+                p->out_read = (p->out_read+1)%p->out_cap;
+        }
+        pthread_mutex_destroy(&p->mutex);
+        if (p->iov != NULL)
+                node_account(p, -(long)(FLUSH_IOV * sizeof(struct iovec)));
+        node_account(p, -(long)(sizeof(Node) + p->in_cap
+                                + p->out_cap * sizeof(Msg *)));
+        __atomic_sub_fetch(&p->w->clients, 1, __ATOMIC_RELAXED);
+        pool_free(p->iov, FLUSH_IOV * sizeof(struct iovec));
+        pool_free(p->in, p->in_cap);
+        pool_free(p->out, p->out_cap * sizeof(Msg *));
+        pool_put(POOL_NODE, p);
+}
+
+/* Create the epoll instance and wakeup eventfd of a reactor thread */
+int worker_init(Worker *w) {
+        struct epoll_event ev;
+
+        w->epfd = epoll_create1(0);
+        if (w->epfd < 0)
+                return -1;
+        w->wakefd = eventfd(0, EFD_NONBLOCK);
+        if (w->wakefd < 0) {
+                close(w->epfd);
+                return -1;
+        }
+        pthread_mutex_init(&w->mutex, NULL);
+        w->pending = NULL;
+        w->fetched = NULL;
+        w->tls = NULL;
+        w->fanout = NULL;
+        w->fanout_tail = &w->fanout;
+        if (runq_init(&w->runq) < 0)
+                return -1;
+        w->inbox.sockets = malloc(opts.inbox * sizeof(int));
+        w->inbox.stamps = malloc(opts.inbox * sizeof(unsigned long));
+        if (w->inbox.sockets == NULL || w->inbox.stamps == NULL)
+                return -1;
+        if (opts.engine == ENGINE_URING)
+                return uring_init(w);
+        /* A NULL data pointer marks the wakeup descriptor */
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev) < 0) {
+                close(w->wakefd);
+                close(w->epfd);
+                return -1;
+        }
+        /* ...and the worker itself marks its own listener */
+        if (opts.reuseport) {
+                ev.events = EPOLLIN;
+                ev.data.ptr = w;
+                if (set_nonblock(w->listener) < 0
+                    || epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->listener,
+                                 &ev) < 0) {
+                        close(w->wakefd);
+                        close(w->epfd);
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/* Tell a worker there are sockets waiting or clients to flush */
+void worker_wake(Worker *w) {
+        uint64_t one = 1;
+
+        if (write(w->wakefd, &one, sizeof(one)) != sizeof(one))
+                log_errno("eventfd write");
+}
+
+/* Pull waiting sockets off the queue and register them with our epoll */
+static void worker_accept(Worker *w) {
+        int sock;
+
+        while ((sock = queue_get(w)) >= 0) {
+                if (set_nonblock(sock) < 0) {
+                        log_errno("fcntl");
+                        close(sock);
+                        continue;
+                }
+                worker_add(w, sock);
+        }
+}
+
+/* Accept straight off our own listener until it runs dry */
+static void worker_listen(Worker *w) {
+        struct sockaddr_storage sa;
+        socklen_t len;
+        int sock;
+
+        while (1) {
+                len = sizeof(sa);
+                sock = accept4(w->listener, (struct sockaddr *)&sa, &len,
+                               SOCK_NONBLOCK);
+                if (sock < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                log_errno("accept");
+                        return;
+                }
+                log_peer(&sa);
+                if (opts.tls_cert != NULL)
+                        tls_add(sock, w);
+                else
+                        worker_add(w, sock);
+        }
+}
+
+/* Make a non-blocking socket one of our clients; NULL if it was closed */
+static Node *worker_add(Worker *w, int sock) {
+        struct epoll_event ev;
+        Node *p;
+        int cpu;
+
+        tune_client(sock);
+        /* How well clients land near their packets, pinned or not */
+        cpu = sock_cpu(sock);
+        if (cpu >= 0 && topo.node[cpu] != w->node)
+                metric_add(&metrics_local()->remote, 1);
+        p = list_append(sock, w);
+        if (p == NULL) {
+                logger_at(LOG_WARN, "out of memory, dropping client");
+                metric_add(&metrics_local()->rejects, 1);
+                close(sock);
+                return NULL;
+        }
+        if (opts.idle || opts.stall) {
+                p->heard = p->progress = now_ns();
+                node_timeout(p, p->heard);
+        }
+        if (opts.engine == ENGINE_URING) {
+                uring_recv(w, p);
+                return p;
+        }
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = p;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+                log_errno("epoll_ctl");
+                client_close(p);
+                return NULL;
+        }
+        return p;
+}
+
+/*
+ * Run queued clients, ours first and then anyone's, up to TASK_BUDGET of
+ * them so new events still get looked at.
+ */
+static void worker_work(Worker *w) {
+        Worker *victim;
+        Node *p;
+        int i, n;
+
+        for (n = 0; n < TASK_BUDGET; n++) {
+                p = runq_pop(&w->runq);
+                if (p == NULL) {
+                        /* Steal from whoever has the longest queue */
+                        victim = NULL;
+                        for (i = 0; i < opts.threads; i++) {
+                                if (&workers[i] == w
+                                    || !runq_size(&workers[i].runq))
+                                        continue;
+                                if (victim == NULL || runq_size(&victim->runq)
+                                    < runq_size(&workers[i].runq))
+                                        victim = &workers[i];
+                        }
+                        if (victim == NULL || (p = runq_pop(&victim->runq))
+                            == NULL)
+                                return;
+                        w->stolen++;
+                }
+                w->tasks++;
+                task_run(p);
+        }
+}
+
+/* Wake one idle worker to take some of our backlog */
+static void worker_help(Worker *w) {
+        int i, one = 1, zero = 0, idx;
+
+        for (i = 1; i < opts.threads; i++) {
+                idx = (w->id + i) % opts.threads;
+                if (__atomic_compare_exchange_n(&workers[idx].idle, &one, zero,
+                                                0, __ATOMIC_SEQ_CST,
+                                                __ATOMIC_SEQ_CST)) {
+                        worker_wake(&workers[idx]);
+                        return;
+                }
+                one = 1;
+        }
+}
+
+/* Set up an empty run queue */
+static int runq_init(RunQueue *q) {
+        pthread_mutex_init(&q->mutex, NULL);
+        q->head = q->tail = 0;
+        q->cap = 64;
+        q->tasks = malloc(q->cap * sizeof(Node *));
+        return q->tasks == NULL ? -1 : 0;
+}
+
+/* Append a client to a run queue, growing it if needed */
+static int runq_push(RunQueue *q, Node *p) {
+        Node **tasks;
+        unsigned i;
+
+        pthread_mutex_lock(&q->mutex);
+        if (q->tail - q->head == q->cap) {
+                tasks = malloc(2 * q->cap * sizeof(Node *));
+                if (tasks == NULL) {
+                        pthread_mutex_unlock(&q->mutex);
+                        return -1;
+                }
+                for (i = 0; i < q->cap; i++)
+                        tasks[i] = q->tasks[(q->head+i) & (q->cap-1)];
+                free(q->tasks);
+                q->tasks = tasks;
+                q->head = 0;
+                q->tail = q->cap;
+                q->cap *= 2;
+        }
+        q->tasks[q->tail++ & (q->cap-1)] = p;
+        pthread_mutex_unlock(&q->mutex);
+        return 0;
+}
+
+/* Take the oldest client off a run queue, or NULL */
+static Node *runq_pop(RunQueue *q) {
+        Node *p = NULL;
+
+        pthread_mutex_lock(&q->mutex);
+        if (q->head != q->tail)
+                p = q->tasks[q->head++ & (q->cap-1)];
+        pthread_mutex_unlock(&q->mutex);
+        return p;
+}
+
+/* Return a racy count of queued clients, fine for balancing decisions */
+static int runq_size(RunQueue *q) {
+        return __atomic_load_n(&q->tail, __ATOMIC_RELAXED)
+                - __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+}
+
+/*
+ * Note that a client is ready for reading or writing and queue it on its
+ * worker unless it is queued or running already. A client is only ever
+ * run by one worker at a time.
+ */
+static void task_mark(Node *p, int ev) {
+        __atomic_or_fetch(&p->ready, ev, __ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&p->queued, 1, __ATOMIC_SEQ_CST))
+                return;
+        if (runq_push(&p->w->runq, p) < 0) {
+                logger_at(LOG_WARN, "out of memory, dropping client");
+                metric_add(&metrics_local()->rejects, 1);
+                client_close(p);
+        }
+}
+
+/* Handle whatever a client is ready for, on whichever worker runs it */
+static void task_run(Node *p) {
+        int ev, ret;
+
+        ev = __atomic_exchange_n(&p->ready, 0, __ATOMIC_SEQ_CST);
+        if ((ev & EV_WRITE) && node_flush(p) < 0) {
+                client_close(p);
+                return;
+        }
+        if (ev & EV_READ) {
+                ret = chat_loop(p);
+                if (ret < 0) {
+                        client_close(p);
+                        return;
+                }
+                if (ret > 0)
+                        __atomic_or_fetch(&p->ready, EV_READ, __ATOMIC_SEQ_CST);
+        }
+        /* Requeue if more became ready while we ran */
+        __atomic_store_n(&p->queued, 0, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&p->ready, __ATOMIC_SEQ_CST))
+                task_mark(p, 0);
+}
+
+/* Periodically log how busy each worker is and how much it stole */
+void *stats_run(void *arg) {
+        unsigned long busy[THREADS_MAX] = {0}, idle[THREADS_MAX] = {0};
+        unsigned long tasks[THREADS_MAX] = {0}, stolen[THREADS_MAX] = {0};
+        unsigned long b, i_, t, s;
+        Worker *w;
+        int i;
+
+        while (1) {
+                sleep(opts.stats);
+                for (i = 0; i < opts.threads; i++) {
+                        w = &workers[i];
+                        b = __atomic_load_n(&w->busy_ns, __ATOMIC_RELAXED);
+                        i_ = __atomic_load_n(&w->idle_ns, __ATOMIC_RELAXED);
+                        t = __atomic_load_n(&w->tasks, __ATOMIC_RELAXED);
+                        s = __atomic_load_n(&w->stolen, __ATOMIC_RELAXED);
+                        logger("worker %d: %3.0f%% busy, %lu tasks, "
+                               "%lu stolen, %d queued", i,
+                               (b - busy[i] + i_ - idle[i]) ?
+                               100.0 * (b - busy[i])
+                               / (b - busy[i] + i_ - idle[i]) : 0.0,
+                               t - tasks[i], s - stolen[i],
+                               runq_size(&w->runq));
+                        busy[i] = b;
+                        idle[i] = i_;
+                        tasks[i] = t;
+                        stolen[i] = s;
+                }
+                stats_clients();
+                stats_pools();
+        }
+        return NULL;
+}
+
+/*
+ * Report what clients cost: the node every client has, plus whatever
+ * send rings, write vectors and partial input they hold right now. Kernel
+ * socket buffers are not included.
+ */
+static void stats_clients(void) {
+        long clients = 0, bytes = 0;
+        int i;
+
+        for (i = 0; i < opts.threads; i++) {
+                clients += __atomic_load_n(&workers[i].clients,
+                                           __ATOMIC_RELAXED);
+                bytes += __atomic_load_n(&workers[i].client_bytes,
+                                         __ATOMIC_RELAXED);
+        }
+        logger("clients: %ld, %ld bytes each (%zu for the node), %ld KB",
+               clients, clients ? bytes / clients : 0, sizeof(Node),
+               bytes >> 10);
+}
+
+/*
+ * Report what each pool holds. Thread caches are read without locking,
+ * so the counts are a snapshot that may be off by a batch.
+ */
+static void stats_pools(void) {
+        unsigned long objects, cached;
+        Depot *d;
+        int i, j;
+
+        for (i = 0; i < POOL_COUNT; i++) {
+                objects = cached = 0;
+                for (j = 0; j < NODES_MAX; j++) {
+                        d = &pools[i].depots[j];
+                        pthread_mutex_lock(&d->mutex);
+                        objects += d->objects;
+                        cached += d->len;
+                        pthread_mutex_unlock(&d->mutex);
+                }
+                if (objects == 0)
+                        continue;
+                pthread_mutex_lock(&pool.mutex);
+                for (j = 0; j < pool.ncaches; j++)
+                        cached += __atomic_load_n(&pool.caches[j][i].len,
+                                                  __ATOMIC_RELAXED);
+                pthread_mutex_unlock(&pool.mutex);
+                logger("pool %s%d: %lu of %lu in use, %lu KB",
+                       i == POOL_NODE ? "node " : "", pools[i].size,
+                       objects - cached, objects,
+                       objects * pools[i].size >> 10);
+        }
+        logger("pools: %lu KB of slabs",
+               __atomic_load_n(&pool.bytes, __ATOMIC_RELAXED) >> 10);
+}
+
+/* Set up the registry the threads' metrics join on first use */
+void metrics_init(void) {
+        metrics.n = 0;
+        pthread_mutex_init(&metrics.mutex, NULL);
+}
+
+/* Return this thread's metrics, registering them the first time */
+static Metrics *metrics_local(void) {
+        Metrics *m;
+
+        if (thread_metrics != NULL)
+                return thread_metrics;
+        m = calloc(1, sizeof(Metrics));
+        pthread_mutex_lock(&metrics.mutex);
+        if (m != NULL && metrics.n < EBR_SLOTS) {
+                metrics.all[metrics.n++] = m;
+        } else {
+                free(m);
+                m = &metrics.spare;
+        }
+        pthread_mutex_unlock(&metrics.mutex);
+        thread_metrics = m;
+        return m;
+}
+
+/*
+ * Bump a counter of this thread's, visible to any reader. Only the spare
+ * block has more than one writer, so only it pays for an atomic add.
+ */
+static void metric_add(unsigned long *counter, unsigned long n) {
+        if (thread_metrics == &metrics.spare)
+                __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+        else
+                __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* Record one sample in a histogram of this thread's */
+static void hist_add(Hist *h, unsigned long v) {
+        metric_add(&h->counts[hist_bucket(v)], 1);
+        metric_add(&h->count, 1);
+        metric_add(&h->sum, v);
+}
+
+/*
+ * Return the bucket holding v. Every power of 2 starts a bucket, so the
+ * samples below one are exactly those in the buckets before its own.
+ */
+static int hist_bucket(unsigned long v) {
+        int e;
+
+        if (v < HIST_SUB)
+                return v;
+        e = 63 - __builtin_clzl(v);
+        return (e - HIST_SHIFT) * HIST_SUB + (v >> (e - HIST_SHIFT));
+}
+
+/* Add one histogram's samples to another's */
+static void hist_merge(Hist *to, Hist *from) {
+        int i;
+
+        for (i = 0; i < HIST_BUCKETS; i++)
+                to->counts[i] += __atomic_load_n(&from->counts[i],
+                                                 __ATOMIC_RELAXED);
+        to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+        to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write a histogram in the Prometheus text format, with a bucket at each
+ * power of 2 from 2^first up to the largest sample. Samples are scaled
+ * into the units reported. A bucket holds the samples below its power of
+ * 2: for integer samples le is that power less one, otherwise le is the
+ * power itself, which only differs for samples exactly on it.
+ */
+static void metrics_hist(FILE *f, const char *name, const char *help,
+                         Hist *h, int first, double scale) {
+        unsigned long below = 0;
+        int b = 0, e;
+
+        fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+        for (e = first; e < 64 && below < h->count; e++) {
+                for (; b < hist_bucket(1UL << e); b++)
+                        below += h->counts[b];
+                fprintf(f, "%s_bucket{le=\"%.9g\"} %lu\n", name,
+                        scale ? (double)(1UL << e) * scale
+                        : (double)((1UL << e) - 1), below);
+        }
+        fprintf(f, "%s_bucket{le=\"+Inf\"} %lu\n", name, h->count);
+        fprintf(f, "%s_sum %g\n%s_count %lu\n", name,
+                scale ? h->sum * scale : (double)h->sum, name, h->count);
+}
+
+/*
+ * Write every thread's metrics, added up, in the Prometheus text format.
+ * Threads go on counting while they are read, so a histogram's buckets
+ * may disagree with its count by the samples taken in between.
+ */
+static void metrics_write(FILE *f) {
+        static const struct {
+                const char *name, *help;
+                size_t off;
+        } counters[] = {
+                { "accepts", "Clients accepted.",
+                  offsetof(Metrics, accepts) },
+                { "rejects", "Clients dropped for lack of memory.",
+                  offsetof(Metrics, rejects) },
+                { "kicks", "Clients disconnected by the overflow policy.",
+                  offsetof(Metrics, kicks) },
+                { "floods", "Times a client went over its rate limit.",
+                  offsetof(Metrics, floods) },
+                { "accept_stalls", "Times accepting paused on full inboxes.",
+                  offsetof(Metrics, stalls) },
+                { "remote_clients", "Clients placed on a worker off the "
+                  "NUMA node their packets arrive on.",
+                  offsetof(Metrics, remote) },
+                { "tls_handshakes", "TLS sessions handed to kernel TLS.",
+                  offsetof(Metrics, handshakes) },
+                { "tls_failures", "TLS clients dropped before the "
+                  "handshake was done.",
+                  offsetof(Metrics, tls_failures) },
+                { "pings", "Pings sent to idle clients.",
+                  offsetof(Metrics, pings) },
+                { "idle_timeouts", "Clients disconnected for not answering "
+                  "a ping.",
+                  offsetof(Metrics, idle_kicks) },
+                { "write_timeouts", "Clients disconnected for not reading "
+                  "what was sent to them.",
+                  offsetof(Metrics, write_kicks) },
+                { "received_bytes", "Bytes read from clients.",
+                  offsetof(Metrics, bytes_in) },
+                { "sent_bytes", "Bytes written to clients.",
+                  offsetof(Metrics, bytes_out) },
+                { "broadcasts", "Messages broadcast to a room.",
+                  offsetof(Metrics, broadcasts) },
+                { "queued_messages", "Messages queued for a client.",
+                  offsetof(Metrics, queued) },
+                { "dropped_messages", "Messages a full send queue lost.",
+                  offsetof(Metrics, dropped) },
+        };
+        Metrics *sum, *m;
+        long clients = 0;
+        int i, j;
+
+        sum = calloc(1, sizeof(Metrics));
+        if (sum == NULL)
+                return;
+        pthread_mutex_lock(&metrics.mutex);
+        for (i = 0; i <= metrics.n; i++) {
+                m = i < metrics.n ? metrics.all[i] : &metrics.spare;
+                for (j = 0; j < sizeof(counters)/sizeof(counters[0]); j++)
+                        *(unsigned long *)((char *)sum + counters[j].off) +=
+                                __atomic_load_n((unsigned long *)((char *)m
+                                                + counters[j].off),
+                                                __ATOMIC_RELAXED);
+                hist_merge(&sum->inbox_wait, &m->inbox_wait);
+                hist_merge(&sum->delivery, &m->delivery);
+                hist_merge(&sum->depth, &m->depth);
+        }
+        pthread_mutex_unlock(&metrics.mutex);
+
+        for (j = 0; j < sizeof(counters)/sizeof(counters[0]); j++)
+                fprintf(f, "# HELP sup_%s_total %s\n"
+                        "# TYPE sup_%s_total counter\nsup_%s_total %lu\n",
+                        counters[j].name, counters[j].help, counters[j].name,
+                        counters[j].name,
+                        *(unsigned long *)((char *)sum + counters[j].off));
+        for (i = 0; i < opts.threads; i++)
+                clients += __atomic_load_n(&workers[i].clients,
+                                           __ATOMIC_RELAXED);
+        fprintf(f, "# HELP sup_clients Clients connected.\n"
+                "# TYPE sup_clients gauge\nsup_clients %ld\n", clients);
+        metrics_hist(f, "sup_inbox_wait_seconds",
+                     "Time an accepted socket waited for its worker.",
+                     &sum->inbox_wait, 10, 1e-9);
+        metrics_hist(f, "sup_delivery_seconds",
+                     "Time from reading a message to queueing it for the "
+                     "room, once per worker a fanned out room spans.",
+                     &sum->delivery, 10, 1e-9);
+        metrics_hist(f, "sup_send_queue_depth",
+                     "Messages in a send queue once one was added.",
+                     &sum->depth, 0, 0);
+        free(sum);
+}
+
+/* Serve metrics to whoever connects to the admin port, one at a time */
+void *admin_run(void *arg) {
+        int sock;
+
+        while (1) {
+                sock = accept(metrics.listener, NULL, NULL);
+                if (sock < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        log_errno("accept");
+                        break;
+                }
+                admin_serve(sock);
+                close(sock);
+        }
+        return NULL;
+}
+
+/*
+ * Answer one scrape. Whatever the request, the reply is the metrics over
+ * HTTP/1.0, so a plain "nc host port" shows them too; a client that sends
+ * nothing gets them after a second.
+ */
+static void admin_serve(int sock) {
+        struct timeval tv = { 1, 0 };
+        char req[ADMIN_REQUEST_MAX];
+        int len = 0, n;
+        char *body, *p;
+        size_t size;
+        FILE *f;
+
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        while (len < sizeof(req)-1) {
+                n = read(sock, req + len, sizeof(req)-1 - len);
+                if (n <= 0)
+                        break;
+                len += n;
+                req[len] = '\0';
+                if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+                        break;
+        }
+        f = open_memstream(&body, &size);
+        if (f == NULL) {
+                log_errno("open_memstream");
+                return;
+        }
+        metrics_write(f);
+        fclose(f);
+        dprintf(sock, "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %zu\r\n\r\n", size);
+        for (p = body; size > 0; p += n, size -= n) {
+                n = write(sock, p, size);
+                if (n < 0) {
+                        if (errno == EINTR) {
+                                n = 0;
+                                continue;
+                        }
+                        log_errno("write");
+                        break;
+                }
+        }
+        free(body);
+}
+
+/* Monotonic clock in nanoseconds */
+static unsigned long now_ns(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Keep a worker on the core topo_init() placed it on */
+static void worker_pin(Worker *w) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (errno)
+                log_errno("pthread_setaffinity_np");
+}
+
+/*
+ * Bind and listen on the first usable address for host and port. With
+ * opts.reuseport set, any number of these may share the address.
+ * Returns the socket, or -1.
+ */
+static int listen_on(const char *host, const char *port, int *family) {
+        struct addrinfo *res, *ap, hints;
+        int sock = -1, on = 1;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, port, &hints, &res)) {
+                log_errno("getaddrinfo");
+                return -1;
+        }
+        /* Bind socket to a valid socket address */
+        for (ap = res; ap != NULL; ap = ap->ai_next) {
+                *family = ap->ai_family;
+                sock = socket(*family, ap->ai_socktype, ap->ai_protocol);
+                /* Peers' links leave TIME_WAITs behind on a restart */
+                if (sock >= 0
+                    && setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+                                  &on, sizeof(on)) >= 0
+                    && (!opts.reuseport
+                        || setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+                                      &on, sizeof(on)) >= 0)
+                    && bind(sock, ap->ai_addr, ap->ai_addrlen) >= 0
+                    && listen(sock, opts.backlog) >= 0)
+                        break;
+                if (sock >= 0)
+                        close(sock);
+                sock = -1;
+        }
+        freeaddrinfo(res);
+        return sock;
+}
+
+/* Deliver the broadcasts posted to us to our share of each room */
+static void worker_fanout(Worker *w) {
+        Fanout *f, *next;
+
+        pthread_mutex_lock(&w->mutex);
+        f = w->fanout;
+        w->fanout = NULL;
+        w->fanout_tail = &w->fanout;
+        pthread_mutex_unlock(&w->mutex);
+        for (; f != NULL; f = next) {
+                next = f->next;
+                room_deliver(&f->room->part[w->id], f->m, f->except, f->seq);
+                hist_add(&metrics_local()->delivery, now_ns() - f->m->born);
+                msg_put(f->m);
+                room_put(f->room);
+                pool_free(f, sizeof(Fanout));
+        }
+}
+
+/* Flush every client that had output queued since the last wakeup */
+static void worker_flush(Worker *w) {
+        Node *p, *next;
+
+        pthread_mutex_lock(&w->mutex);
+        p = w->pending;
+        w->pending = NULL;
+        pthread_mutex_unlock(&w->mutex);
+        for (; p != NULL; p = next) {
+                pthread_mutex_lock(&p->mutex);
+                next = p->pnext;
+                p->pending = 0;
+                pthread_mutex_unlock(&p->mutex);
+                if (opts.engine == ENGINE_URING) {
+                        if (uring_send(w, p) < 0)
+                                client_close(p);
+                } else {
+                        task_mark(p, EV_WRITE);
+                }
+        }
+}
+
+/*
+ * Go on with the clients the journal has caught up. One closed meanwhile
+ * is retired here, unless io_uring operations still name it.
+ */
+static void worker_fetched(Worker *w) {
+        Node *p, *next;
+        int dead;
+
+        pthread_mutex_lock(&w->mutex);
+        p = w->fetched;
+        w->fetched = NULL;
+        pthread_mutex_unlock(&w->mutex);
+        for (; p != NULL; p = next) {
+                next = p->fetch_next;
+                pthread_mutex_lock(&p->mutex);
+                __atomic_store_n(&p->fetching, 0, __ATOMIC_RELEASE);
+                dead = p->dead;
+                pthread_mutex_unlock(&p->mutex);
+                if (dead) {
+                        if (!p->inflight)
+                                ebr_retire(p, node_free);
+                } else if (opts.engine == ENGINE_URING) {
+                        /* A parked client goes on once it is unparked */
+                        if (!p->parked)
+                                uring_resume(w, p);
+                } else {
+                        task_mark(p, EV_READ);
+                }
+        }
+}
+
+/*
+ * Forget about a client; closing also removes it from the epoll set. A
+ * node still named by io_uring operations is shut down so they complete,
+ * and is retired by the last of them; one the journal is catching up, by
+ * worker_fetched().
+ */
+static void client_close(Node *p) {
+        Worker *w = p->w;
+        Node **pp;
+        int fetching;
+
+        /*
+         * Once off the list no new broadcaster can reach it, and marking
+         * it closing turns away the ones still holding the old table.
+         */
+        list_delete(p);
+        room_leave(p);
+        if (p->fetch_room != NULL) {
+                room_put(p->fetch_room);
+                p->fetch_room = NULL;
+        }
+        /* Whichever of us and worker_fetched() is second retires it */
+        pthread_mutex_lock(&p->mutex);
+        p->dead = 1;
+        p->closing = 1;
+        fetching = p->fetching;
+        pthread_mutex_unlock(&p->mutex);
+        pthread_mutex_lock(&w->mutex);
+        for (pp = &w->pending; *pp != NULL; pp = &(*pp)->pnext) {
+                if (*pp == p) {
+                        *pp = p->pnext;
+                        break;
+                }
+        }
+        for (pp = &w->parked; p->parked && *pp != NULL;
+             pp = &(*pp)->park_next) {
+                if (*pp == p) {
+                        *pp = p->park_next;
+                        break;
+                }
+        }
+        wheel_del(&w->wheel, &p->timer);
+        pthread_mutex_unlock(&w->mutex);
+        if (p->inflight || fetching) {
+                shutdown(p->sock, SHUT_RDWR);
+                close(p->sock);
+                return;
+        }
+        close(p->sock);
+        ebr_retire(p, node_free);
+        ebr_reclaim();
+}
+
+/* Put a socket in non-blocking mode */
+static int set_nonblock(int sock) {
+        int flags;
+
+        flags = fcntl(sock, F_GETFL, 0);
+        if (flags < 0)
+                return -1;
+        return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * Set what sockets accepted from a client listener inherit. Buffer sizes
+ * have to be there already when a connection's window scale is agreed.
+ */
+static void tune_listener(int sock) {
+        Tuning *t = &opts.tune;
+
+        if (t->sndbuf && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &t->sndbuf,
+                                    sizeof(int)) < 0)
+                log_errno("SO_SNDBUF");
+        if (t->rcvbuf && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &t->rcvbuf,
+                                    sizeof(int)) < 0)
+                log_errno("SO_RCVBUF");
+        /* Raising it past net.core.busy_read needs CAP_NET_ADMIN */
+        if (t->busy_poll && setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL,
+                                       &t->busy_poll, sizeof(int)) < 0)
+                log_errno("SO_BUSY_POLL");
+        if (t->defer_accept && setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                                          &t->defer_accept, sizeof(int)) < 0)
+                log_errno("TCP_DEFER_ACCEPT");
+}
+
+/* Set the options a client's own socket takes as it is taken on */
+static void tune_client(int sock) {
+        Tuning *t = &opts.tune;
+
+        if (t->nodelay && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+                                     &t->nodelay, sizeof(int)) < 0)
+                log_errno("TCP_NODELAY");
+        if (t->notsent_lowat && setsockopt(sock, IPPROTO_TCP,
+                                           TCP_NOTSENT_LOWAT,
+                                           &t->notsent_lowat,
+                                           sizeof(int)) < 0)
+                log_errno("TCP_NOTSENT_LOWAT");
+}
+
+/* Map an overflow policy name to its value, or -1 */
+static int parse_overflow(const char *name) {
+        if (!strcmp(name, "oldest"))
+                return DROP_OLDEST;
+        if (!strcmp(name, "newest"))
+                return DROP_NEWEST;
+        if (!strcmp(name, "disconnect"))
+                return DISCONNECT;
+        return -1;
+}
+
+/* Map a -l argument to its log level, or -1 */
+static int parse_level(const char *name) {
+        static const char *names[] = { "error", "warn", "info", "debug" };
+        int i;
+
+        for (i = 0; i < sizeof(names)/sizeof(names[0]); i++)
+                if (!strcmp(name, names[i]))
+                        return i;
+        return -1;
+}
+
+/* Parse a whole unsigned decimal number, or return -1 */
+static int parse_num(const char *s, unsigned long *n) {
+        char *end;
+
+        errno = 0;
+        *n = strtoul(s, &end, 10);
+        return errno || end == s || *end || *s == '-' ? -1 : 0;
+}
+
+/*
+ * Setters for what the command line and config files may change, each
+ * returning -1 for a value it won't take. Those marked live in settings
+ * store atomically, as they are also set while workers read them.
+ */
+static int set_threads(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n > THREADS_MAX)
+                return -1;
+        opts.threads = n;       /* 0 sizes the pool from the CPUs */
+        return 0;
+}
+
+/* Rounded up to a power of 2, which the free-running indices need */
+static int set_inbox(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n == 0 || n > (1 << 20))
+                return -1;
+        for (opts.inbox = 1; opts.inbox < n; opts.inbox *= 2)
+                ;
+        return 0;
+}
+
+/* One byte more than the smallest read, for chat_input()'s NUL */
+static int set_read_size(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n < 2 || n > READ_MAX)
+                return -1;
+        opts.read_size = n;
+        return 0;
+}
+
+static int set_backlog(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n == 0 || n > (1 << 20))
+                return -1;
+        opts.backlog = n;
+        return 0;
+}
+
+static int set_queue(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n == 0 || n > (1 << 20))
+                return -1;
+        opts.out_max = n;
+        return 0;
+}
+
+static int set_history(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n > (1 << 20))
+                return -1;
+        opts.history = n;
+        return 0;
+}
+
+static int set_overflow(const char *value) {
+        int policy = parse_overflow(value);
+
+        if (policy < 0)
+                return -1;
+        __atomic_store_n(&opts.overflow, policy, __ATOMIC_RELAXED);
+        return 0;
+}
+
+/* In megabytes, 0 for no limit */
+static int set_memory(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n > (1UL << 40))
+                return -1;
+        __atomic_store_n(&opts.mem_max, n << 20, __ATOMIC_RELAXED);
+        return 0;
+}
+
+/* Per client, 0 for no limit */
+static int set_msg_rate(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n > 1000000000UL)
+                return -1;
+        __atomic_store_n(&opts.msg_rate, n, __ATOMIC_RELAXED);
+        return 0;
+}
+
+static int set_byte_rate(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n > 1000000000UL)
+                return -1;
+        __atomic_store_n(&opts.byte_rate, n, __ATOMIC_RELAXED);
+        return 0;
+}
+
+/* What happens to a client over its rate */
+static int set_flood(const char *value) {
+        if (strcmp(value, "pause") && strcmp(value, "disconnect"))
+                return -1;
+        __atomic_store_n(&opts.flood_kick, !strcmp(value, "disconnect"),
+                         __ATOMIC_RELAXED);
+        return 0;
+}
+
+static int set_log_level(const char *value) {
+        int level = parse_level(value);
+
+        if (level < 0)
+                return -1;
+        __atomic_store_n(&opts.log_level, level, __ATOMIC_RELAXED);
+        return 0;
+}
+
+/* Map on or off to 1 or 0, or -1 */
+static int parse_switch(const char *value) {
+        if (!strcmp(value, "on"))
+                return 1;
+        if (!strcmp(value, "off"))
+                return 0;
+        return -1;
+}
+
+static int set_pin(const char *value) {
+        int on = parse_switch(value);
+
+        if (on < 0)
+                return -1;
+        opts.pin = on;
+        return 0;
+}
+
+/*
+ * Choose a set of client socket options as a whole. Latency sends every
+ * line at once and keeps no more than a little unsent in the kernel, so
+ * a slow reader's backlog stays in its queue, where the overflow policy
+ * sees it. Throughput lets Nagle and corking fill segments, gives the
+ * kernel big buffers, and only hands over connections with data waiting.
+ * Options set after this adjust the chosen profile.
+ */
+static int set_tuning(const char *value) {
+        static const struct {
+                const char *name;
+                Tuning tune;
+        } profiles[] = {
+                { "default", { 0, 0, 0, 0, 0, 0, 0 } },
+                { "latency", { 1, 0, 0, 0, 16384, 50, 0 } },
+                { "throughput", { 0, 1, 1 << 20, 1 << 20, 0, 0, 1 } },
+        };
+        int i;
+
+        for (i = 0; i < sizeof(profiles)/sizeof(profiles[0]); i++) {
+                if (!strcmp(value, profiles[i].name)) {
+                        opts.tune = profiles[i].tune;
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+static int set_nodelay(const char *value) {
+        int on = parse_switch(value);
+
+        if (on < 0)
+                return -1;
+        opts.tune.nodelay = on;
+        return 0;
+}
+
+static int set_cork(const char *value) {
+        int on = parse_switch(value);
+
+        if (on < 0)
+                return -1;
+        opts.tune.cork = on;
+        return 0;
+}
+
+/* A byte count or time for a socket option, 0 to leave it be */
+static int set_sockopt(int *opt, const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n > (1 << 30))
+                return -1;
+        *opt = n;
+        return 0;
+}
+
+static int set_sndbuf(const char *value) {
+        return set_sockopt(&opts.tune.sndbuf, value);
+}
+
+static int set_rcvbuf(const char *value) {
+        return set_sockopt(&opts.tune.rcvbuf, value);
+}
+
+static int set_notsent_lowat(const char *value) {
+        return set_sockopt(&opts.tune.notsent_lowat, value);
+}
+
+static int set_busy_poll(const char *value) {
+        return set_sockopt(&opts.tune.busy_poll, value);
+}
+
+static int set_defer_accept(const char *value) {
+        return set_sockopt(&opts.tune.defer_accept, value);
+}
+
+/* Paths are copied, since a config file's lines don't last */
+static int set_tls_cert(const char *value) {
+        return (opts.tls_cert = strdup(value)) == NULL ? -1 : 0;
+}
+
+static int set_tls_key(const char *value) {
+        return (opts.tls_key = strdup(value)) == NULL ? -1 : 0;
+}
+
+static int set_idle(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n > 86400)
+                return -1;
+        opts.idle = n;
+        return 0;
+}
+
+static int set_stall(const char *value) {
+        unsigned long n;
+
+        if (parse_num(value, &n) < 0 || n > 86400)
+                return -1;
+        opts.stall = n;
+        return 0;
+}
+
+/*
+ * What a config file may hold, one "name value" per line; blank lines
+ * and lines starting with # are skipped. Only live settings are applied
+ * again when SIGHUP has the file re-read: the rest size structures made
+ * at startup, and keep the values they had then.
+ */
+static const struct {
+        const char *name;
+        int (*set)(const char *value);
+        int live;
+} settings[] = {
+        { "threads", set_threads, 0 },
+        { "inbox", set_inbox, 0 },
+        { "read_size", set_read_size, 0 },
+        { "backlog", set_backlog, 0 },
+        { "queue", set_queue, 0 },
+        { "history", set_history, 0 },
+        { "overflow", set_overflow, 1 },
+        { "memory", set_memory, 1 },
+        { "msg_rate", set_msg_rate, 1 },
+        { "byte_rate", set_byte_rate, 1 },
+        { "flood", set_flood, 1 },
+        { "log_level", set_log_level, 1 },
+        { "pin", set_pin, 0 },
+        { "tuning", set_tuning, 0 },
+        { "nodelay", set_nodelay, 0 },
+        { "cork", set_cork, 0 },
+        { "sndbuf", set_sndbuf, 0 },
+        { "rcvbuf", set_rcvbuf, 0 },
+        { "notsent_lowat", set_notsent_lowat, 0 },
+        { "busy_poll", set_busy_poll, 0 },
+        { "defer_accept", set_defer_accept, 0 },
+        { "tls_cert", set_tls_cert, 0 },
+        { "tls_key", set_tls_key, 0 },
+        { "idle_timeout", set_idle, 0 },
+        { "write_timeout", set_stall, 0 },
+};
+
+/*
+ * Apply the settings in a config file, only the live ones on a reload.
+ * Returns -1 if it could not be read or has a bad line, which is logged
+ * and skipped; the good lines still take effect.
+ */
+int config_load(const char *path, int reload) {
+        char line[CONFIG_LINE], name[CONFIG_LINE], value[CONFIG_LINE];
+        int i, n, got, lineno = 0, ret = 0;
+        FILE *f;
+
+        f = fopen(path, "r");
+        if (f == NULL) {
+                log_errno(path);
+                return -1;
+        }
+        n = sizeof(settings)/sizeof(settings[0]);
+        while (fgets(line, sizeof(line), f) != NULL) {
+                lineno++;
+                got = sscanf(line, "%255s %255s", name, value);
+                if (got < 1 || name[0] == '#')
+                        continue;
+                for (i = 0; i < n; i++)
+                        if (!strcmp(name, settings[i].name))
+                                break;
+                if (i == n) {
+                        logger_at(LOG_ERROR, "%s:%d: unknown setting %s",
+                                  path, lineno, name);
+                        ret = -1;
+                } else if ((!reload || settings[i].live)
+                           && (got < 2 || settings[i].set(value) < 0)) {
+                        logger_at(LOG_ERROR, "%s:%d: bad value for %s",
+                                  path, lineno, name);
+                        ret = -1;
+                }
+        }
+        fclose(f);
+        if (reload)
+                logger("reloaded %s", path);
+        return ret;
+}
+
+/* Re-read the config file whenever SIGHUP, blocked everywhere else, comes */
+void *config_run(void *arg) {
+        sigset_t set;
+        int sig;
+
+        sigemptyset(&set);
+        sigaddset(&set, SIGHUP);
+        while (sigwait(&set, &sig) == 0)
+                config_load(opts.config, 1);
+        return NULL;
+}
+
+/* Find the CPUs we may use, the NUMA node of each, and the order to fill */
+void topo_init(void) {
+        char path[300], list[4096], *s;
+        struct dirent *e;
+        cpu_set_t set;
+        int cpu, last, node, more;
+        FILE *f;
+        DIR *d;
+
+        if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+                CPU_ZERO(&set);
+                for (cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN)
+                     && cpu < CPU_SETSIZE; cpu++)
+                        CPU_SET(cpu, &set);
+        }
+        topo.nnodes = 1;
+        d = opendir("/sys/devices/system/node");
+        while (d != NULL && (e = readdir(d)) != NULL) {
+                if (sscanf(e->d_name, "node%d", &node) != 1 || node < 0)
+                        continue;
+                snprintf(path, sizeof(path),
+                         "/sys/devices/system/node/%s/cpulist", e->d_name);
+                if ((f = fopen(path, "r")) == NULL)
+                        continue;
+                /* Ranges like "0-3,8-11" */
+                for (s = fgets(list, sizeof(list), f); s != NULL && *s; s++) {
+                        cpu = last = strtol(s, &s, 10);
+                        if (*s == '-')
+                                last = strtol(s+1, &s, 10);
+                        for (; cpu >= 0 && cpu <= last && cpu < CPU_SETSIZE;
+                             cpu++)
+                                topo.node[cpu] = node;
+                        if (*s != ',')
+                                break;
+                }
+                fclose(f);
+                if (node >= topo.nnodes)
+                        topo.nnodes = node+1;
+        }
+        if (d != NULL)
+                closedir(d);
+        /* Deal the CPUs out one from each node at a time */
+        for (topo.ncpus = 0, more = 1; more; ) {
+                more = 0;
+                for (node = 0; node < topo.nnodes; node++) {
+                        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                                if (CPU_ISSET(cpu, &set)
+                                    && topo.node[cpu] == node)
+                                        break;
+                        if (cpu == CPU_SETSIZE)
+                                continue;
+                        CPU_CLR(cpu, &set);
+                        topo.order[topo.ncpus++] = cpu;
+                        more = 1;
+                }
+        }
+        if (topo.ncpus == 0)
+                topo.ncpus = 1;
+}
+
+/* Log where a new connection came from */
+static void log_peer(struct sockaddr_storage *sa) {
+        char hostname[256];
+        void *src;
+
+        if (opts.log_level < LOG_INFO)
+                return;
+        src = (sa->ss_family == AF_INET6) ?
+                (void *)&((struct sockaddr_in6 *)sa)->sin6_addr :
+                (void *)&((struct sockaddr_in *)sa)->sin_addr;
+        if (inet_ntop(sa->ss_family, src, hostname, sizeof(hostname)) != NULL)
+                logger("new connection from %s!", hostname);
+}
+
+/* Lift the soft descriptor limit up to the hard limit */
+static void raise_fd_limit(void) {
+        struct rlimit rl;
+
+        if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+                return;
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+                log_errno("setrlimit");
+        else
+                logger("descriptor limit %lu", (unsigned long)rl.rlim_cur);
+}
+
+/* Wait for socket events and dispatch them to their clients */
+void *run(void *arg) {
+        Worker *w = arg;
+        struct epoll_event events[MAX_EVENTS];
+        unsigned long t;
+        uint64_t count;
+        Node *p;
+        int i, n, ev;
+
+        if (ebr_register() < 0) {
+                logger_at(LOG_ERROR, "out of reader slots");
+                return NULL;
+        }
+        if (opts.reuseport || opts.pin)
+                worker_pin(w);
+        if (opts.engine == ENGINE_URING) {
+                uring_run(w);
+                return NULL;
+        }
+        while (1) {
+                /* Don't sleep on clients that used up their turn */
+                t = now_ns();
+                __atomic_store_n(&w->idle, 1, __ATOMIC_SEQ_CST);
+                n = epoll_wait(w->epfd, events, MAX_EVENTS,
+                               runq_size(&w->runq) ? 0
+                               : __atomic_load_n(&w->parked, __ATOMIC_RELAXED)
+                               ? PARK_MS
+                               : __atomic_load_n(&w->wheel.count,
+                                                 __ATOMIC_RELAXED)
+                               ? WHEEL_TICK_MS : -1);
+                __atomic_store_n(&w->idle, 0, __ATOMIC_SEQ_CST);
+                w->idle_ns += now_ns() - t;
+                if (__atomic_load_n(&upgrade.freezing, __ATOMIC_SEQ_CST))
+                        upgrade_stop();
+                t = now_ns();
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        log_errno("epoll_wait");
+                        break;
+                }
+                /*
+                 * Handle the batch inside a read section, so a client closed
+                 * by one event stays valid for any later event naming it.
+                 */
+                ebr_enter();
+                worker_unpark(w);
+                worker_tick(w);
+                for (i = 0; i < n; i++) {
+                        p = events[i].data.ptr;
+                        if (p == (Node *)w) {
+                                worker_listen(w);
+                                continue;
+                        }
+                        if (p == NULL) {
+                                if (read(w->wakefd, &count, sizeof(count)) < 0
+                                    && errno != EAGAIN)
+                                        log_errno("eventfd read");
+                                worker_accept(w);
+                                tls_take(w);
+                                worker_fetched(w);
+                                worker_fanout(w);
+                                worker_flush(w);
+                                continue;
+                        }
+                        if (p->dead)
+                                continue;
+                        ev = 0;
+                        if (events[i].events & EPOLLOUT)
+                                ev |= EV_WRITE;
+                        if (events[i].events & ~EPOLLOUT)
+                                ev |= EV_READ;
+                        task_mark(p, ev);
+                }
+                if (runq_size(&w->runq) > STEAL_MIN)
+                        worker_help(w);
+                worker_work(w);
+                ebr_exit();
+                ebr_reclaim();
+                w->busy_ns += now_ns() - t;
+        }
+        return NULL;
+}
+
+/*
+ * Broadcast every message received to other clients. Edge-triggered, so
+ * keep reading until the socket runs dry, but give up the worker after
+ * READ_BUDGET reads, or as soon as the client is over its rate. Messages
+ * left over from when it last went over are handled before reading more,
+ * and nothing is read while the journal catches the client up. Returns
+ * -1 once the client is gone and should be closed, 1 if there may be
+ * more to read.
+ */
+int chat_loop(Node *p) {
+        char buf[opts.read_size];
+        unsigned long until;
+        int bytes_read, reads = 0;
+
+        while (1) {
+                if (reads++ == READ_BUDGET)
+                        return 1;
+                /* Handed back by worker_fetched(), which makes it ready */
+                if (p->fetch_room != NULL) {
+                        if (__atomic_load_n(&p->fetching, __ATOMIC_ACQUIRE))
+                                return 0;
+                        chat_fetched(p);
+                        continue;
+                }
+                /* Leave what an over-rate client sent in the socket */
+                if ((until = node_over(p)))
+                        return node_park(p, until);
+                if (p->in_held) {
+                        if (chat_resume(p) < 0) {
+                                logger("Client broke the protocol!");
+                                return -1;
+                        }
+                        continue;
+                }
+                bytes_read = read(p->sock, buf, sizeof(buf)-1);
+                if (bytes_read < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return 0;
+                        if (errno == EINTR)
+                                continue;
+                        log_errno("read");
+                        return -1;
+                }
+                if (!bytes_read) {
+                        logger("Client closed connection!");
+                        return -1;
+                }
+                if (chat_input(p, buf, bytes_read) < 0) {
+                        logger("Client broke the protocol!");
+                        return -1;
+                }
+        }
+}
+
+/*
+ * Handle what one read returned. In raw mode it is broadcast to the
+ * client's room as is, unless it is a command; buf must have room for
+ * the NUL appended after the len bytes read. Each message counts against
+ * the client's rate before it is acted on, commands included. Returns -1
+ * if the client broke the framing and should be closed.
+ */
+int chat_input(Node *p, char *buf, int len) {
+        Msg *m;
+
+        metric_add(&metrics_local()->bytes_in, len);
+        /* Anything at all answers a ping */
+        if (opts.idle)
+                __atomic_store_n(&p->heard, now_ns(), __ATOMIC_RELAXED);
+        if (opts.proto == PROTO_FRAMED)
+                return chat_frames(p, buf, len);
+        if (opts.proto == PROTO_LINES)
+                return chat_lines(p, buf, len);
+        node_charge(p, len);
+        buf[len] = '\0';
+        if (!strncmp(buf, "/join ", 6) || !strncmp(buf, "/leave", 6))
+                return chat_command(p, buf);
+        if (!strncmp(buf, "/pong", 5))
+                return 0;
+        if (p->room == NULL)
+                return 0;
+        m = msg_new(buf, len+1);
+        if (m == NULL)
+                return 0;
+        chat_send(p, m);
+        return 0;
+}
+
+/* Parse a "/join <room> [since]" or "/leave" */
+int chat_command(Node *p, char *line) {
+        char name[ROOM_NAME_MAX+1];
+        long since = -1;
+
+        if (sscanf(line, "/join %32s %ld", name, &since) >= 1)
+                return chat_join(p, name, since);
+        return chat_join(p, NULL, -1);
+}
+
+/*
+ * Handle every whole frame in what was read, keeping a trailing partial
+ * one for the next read. Frames are handled straight out of buf unless
+ * one was already split across reads. Once the client is over its rate,
+ * or is waiting on the journal, the rest is kept too, for when it can go
+ * on. Returns -1 on a bad frame.
+ */
+int chat_frames(Node *p, char *buf, int len) {
+        uint32_t n;
+        int off = 0;
+
+        if (p->in_len) {
+                if (in_reserve(p, p->in_len + len) < 0)
+                        return -1;
+                memcpy(p->in + p->in_len, buf, len);
+                p->in_len += len;
+                buf = p->in;
+                len = p->in_len;
+        }
+        p->in_held = 0;
+        while (len - off >= FRAME_HDR) {
+                memcpy(&n, buf + off, 4);
+                n = ntohl(n);
+                if (n > FRAME_MAX)
+                        return -1;
+                if (len - off < FRAME_HDR + n)
+                        break;
+                if ((p->in_held = node_over(p) || p->fetch_room != NULL))
+                        break;
+                node_charge(p, FRAME_HDR + n);
+                if (chat_frame(p, buf[off+4], buf + off + FRAME_HDR, n) < 0)
+                        return -1;
+                off += FRAME_HDR + n;
+        }
+        len -= off;
+        if (buf == p->in) {
+                memmove(p->in, p->in + off, len);
+        } else if (len) {
+                if (in_reserve(p, len) < 0)
+                        return -1;
+                memcpy(p->in, buf + off, len);
+        }
+        p->in_len = len;
+        in_trim(p);
+        return 0;
+}
+
+/*
+ * Handle every whole line in what was read, keeping a trailing partial
+ * one for the next read. As with frames, the input buffer is only used
+ * once a line is split across reads, and then only the new bytes are
+ * searched, unless whole lines were held back, as frames are.
+ * Returns -1 if a line grows past LINE_MAX.
+ */
+int chat_lines(Node *p, char *buf, int len) {
+        int off = 0, from = 0, nl;
+
+        if (p->in_len) {
+                if (in_reserve(p, p->in_len + len) < 0)
+                        return -1;
+                memcpy(p->in + p->in_len, buf, len);
+                from = p->in_held ? 0 : p->in_len;
+                p->in_len += len;
+                buf = p->in;
+                len = p->in_len;
+        }
+        p->in_held = 0;
+        while ((nl = line_find(buf + from, len - from)) >= 0) {
+                if ((p->in_held = node_over(p) || p->fetch_room != NULL))
+                        break;
+                nl += from;
+                node_charge(p, nl - off + 1);
+                chat_line(p, buf + off, nl - off);
+                off = from = nl + 1;
+        }
+        len -= off;
+        if (len > LINE_MAX && !p->in_held)
+                return -1;
+        if (buf == p->in) {
+                memmove(p->in, p->in + off, len);
+        } else if (len) {
+                if (in_reserve(p, len) < 0)
+                        return -1;
+                memcpy(p->in, buf + off, len);
+        }
+        p->in_len = len;
+        in_trim(p);
+        return 0;
+}
+
+/*
+ * Go on with the messages a client had held back, now that it is under
+ * its rate and not waiting on the journal. Returns -1 as chat_input()
+ * does.
+ */
+static int chat_resume(Node *p) {
+        /* Nothing new is read: the input buffer is handled where it is */
+        if (opts.proto == PROTO_FRAMED)
+                return chat_frames(p, p->in + p->in_len, 0);
+        return chat_lines(p, p->in + p->in_len, 0);
+}
 
-struct Node {
-        Node *next;
-        int sock;
-};
+/*
+ * Act on one line, given without its newline, which is still there in
+ * the buffer and may be overwritten. A carriage return before it is
+ * dropped.
+ */
+int chat_line(Node *p, char *line, int len) {
+        Msg *m;
 
-void queue_init(void);
-int queue_add(int sock);
-int queue_get(void);
+        if (len && line[len-1] == '\r')
+                len--;
+        line[len] = '\0';
+        if (!strncmp(line, "/join ", 6) || !strcmp(line, "/leave"))
+                return chat_command(p, line);
+        if (!strcmp(line, "/pong"))
+                return 0;
+        if (p->room == NULL)
+                return 0;
+        line[len] = '\n';
+        m = msg_new(line, len+1);
+        if (m == NULL)
+                return 0;
+        chat_send(p, m);
+        return 0;
+}
 
-static int queue_size(void);
+/*
+ * Pick the newline search to use. memchr() is hard to beat on anything
+ * but short lines, so the vector versions are only taken where they beat
+ * it here, timed over chat-length and long lines alike.
+ */
+void line_init(void) {
+#ifdef __x86_64__
+        static const struct {
+                const char *name;
+                int (*find)(const char *, int);
+        } finds[] = {
+                { "memchr", line_find_memchr },
+                { "sse2", line_find_sse2 },
+                { "avx2", line_find_avx2 },
+        };
+        unsigned long t, best = -1UL;
+        int i, n = 2, pick = 0;
+        char *buf;
+#endif
 
-void list_init(void);
-void list_delete(int sock);
-Node *list_append(int sock);
-int list_broadcast(char *buf, int len, int except);
+        line_find = line_find_memchr;
+#ifdef __x86_64__
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+                n = 3;
+        buf = malloc(2 * LINE_PROBE);
+        if (buf == NULL)
+                return;
+        for (i = 0; i < 2 * LINE_PROBE; i++)
+                buf[i] = (i+1) % (i < LINE_PROBE ? 80 : 4096) ? 'x' : '\n';
+        for (i = 0; i < n; i++) {
+                t = line_time(finds[i].find, buf, 2 * LINE_PROBE);
+                if (t < best) {
+                        best = t;
+                        pick = i;
+                }
+        }
+        free(buf);
+        line_find = finds[pick].find;
+        logger_at(LOG_DEBUG, "newline search: %s", finds[pick].name);
+#endif
+}
 
-void *run(void *arg);
-void chat_loop(int client);
+static int line_find_memchr(const char *buf, int len) {
+        const char *nl = memchr(buf, '\n', len);
 
-void logger(const char *format, ...) {
-        va_list ap;
+        return nl == NULL ? -1 : nl - buf;
+}
 
-        va_start(ap, format);
-        fprintf(stderr, "sup: ");
-        vfprintf(stderr, format, ap);
-        va_end(ap);
-        fprintf(stderr, "\n");
+#ifdef __x86_64__
+/* Best of three runs of finding every line in buf, in ns, warm */
+static unsigned long line_time(int (*find)(const char *, int),
+                               const char *buf, int len) {
+        unsigned long t, best = -1UL;
+        int i, r, off, nl;
+
+        for (i = 0; i < 4; i++) {
+                t = now_ns();
+                for (r = 0; r < PROBE_ROUNDS; r++)
+                        for (off = 0; (nl = find(buf + off, len - off)) >= 0; )
+                                off += nl + 1;
+                t = now_ns() - t;
+                /* The first run only warms the cache */
+                if (i && t < best)
+                        best = t;
+        }
+        return best;
 }
 
-int main(int argc, char *argv[]) {
-        struct addrinfo *res, *ap, hints;
-        struct sockaddr sa;
-        socklen_t len = sizeof(struct sockaddr);
-        char hostname[256];
-        int family;
-        int listener, client, i;
-        pthread_t worker_th;
-        void *src;
+/*
+ * Whether a vector load of n bytes at p stays within its page. Loads
+ * that read past the end of the buffer are fine as long as they can't
+ * fault; the bytes past the end are masked off.
+ */
+#define LOAD_SAFE(p, n) (((uintptr_t)(p) & 4095) <= 4096 - (n))
+
+/* One bit per byte of two 32-byte compare results */
+#define MOVEMASK64(a, b) ((unsigned)_mm256_movemask_epi8(a) \
+        | (unsigned long)(unsigned)_mm256_movemask_epi8(b) << 32)
+
+/*
+ * Sixteen bytes a compare, four at a time over long runs; SSE2 is always
+ * there on x86-64.
+ */
+__attribute__((no_sanitize_address))
+static int line_find_sse2(const char *buf, int len) {
+        __m128i nl = _mm_set1_epi8('\n');
+        const __m128i *v;
+        unsigned long mask;
+        int i;
 
-        if (argc != 3) {
-                printf("Usage: %s <ip> <port>\n", argv[0]);
+        for (i = 0; i + 64 <= len; i += 64) {
+                v = (const __m128i *)(buf + i);
+                mask = _mm_movemask_epi8(
+                        _mm_cmpeq_epi8(_mm_loadu_si128(v), nl))
+                        | (unsigned long)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(_mm_loadu_si128(v+1), nl)) << 16
+                        | (unsigned long)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(_mm_loadu_si128(v+2), nl)) << 32
+                        | (unsigned long)_mm_movemask_epi8(
+                        _mm_cmpeq_epi8(_mm_loadu_si128(v+3), nl)) << 48;
+                if (mask)
+                        return i + __builtin_ctzl(mask);
+        }
+        for (; i < len; i += 16) {
+                if (i + 16 > len && !LOAD_SAFE(buf + i, 16))
+                        break;
+                v = (const __m128i *)(buf + i);
+                mask = _mm_movemask_epi8(
+                        _mm_cmpeq_epi8(_mm_loadu_si128(v), nl));
+                if (i + 16 > len)
+                        mask &= (1ul << (len - i)) - 1;
+                if (mask)
+                        return i + __builtin_ctzl(mask);
+        }
+        for (; i < len; i++)
+                if (buf[i] == '\n')
+                        return i;
+        return -1;
+}
+
+/*
+ * Thirty-two bytes a compare. After the first, unaligned, block loads
+ * are aligned, four to a step over long runs, and an aligned load can't
+ * cross a page so it may run past len with the excess masked off.
+ */
+__attribute__((target("avx2"), no_sanitize_address))
+static int line_find_avx2(const char *buf, int len) {
+        __m256i nl = _mm256_set1_epi8('\n');
+        __m256i a, b, c, d;
+        const __m256i *v;
+        unsigned long mask;
+        int i;
+
+        /* With nothing to search, buf may not even be mapped */
+        if (len < 32 && (len == 0 || !LOAD_SAFE(buf, 32)))
+                return line_find_sse2(buf, len);
+        mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)buf), nl));
+        if (len < 32)
+                mask &= (1ul << len) - 1;
+        if (mask)
+                return __builtin_ctzl(mask);
+        /* Go on from the next 32-byte boundary, overlapping the first */
+        i = 32 - ((uintptr_t)buf & 31);
+        for (; i + 128 <= len; i += 128) {
+                v = (const __m256i *)(buf + i);
+                a = _mm256_cmpeq_epi8(_mm256_load_si256(v), nl);
+                b = _mm256_cmpeq_epi8(_mm256_load_si256(v+1), nl);
+                c = _mm256_cmpeq_epi8(_mm256_load_si256(v+2), nl);
+                d = _mm256_cmpeq_epi8(_mm256_load_si256(v+3), nl);
+                if (_mm256_testz_si256(_mm256_or_si256(a, b),
+                                       _mm256_or_si256(a, b))
+                    && _mm256_testz_si256(_mm256_or_si256(c, d),
+                                          _mm256_or_si256(c, d)))
+                        continue;
+                mask = MOVEMASK64(a, b);
+                if (mask)
+                        return i + __builtin_ctzl(mask);
+                return i + 64 + __builtin_ctzl(MOVEMASK64(c, d));
+        }
+        for (; i < len; i += 32) {
+                mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                        _mm256_load_si256((const __m256i *)(buf + i)), nl));
+                if (i + 32 > len)
+                        mask &= (1ul << (len - i)) - 1;
+                if (mask)
+                        return i + __builtin_ctzl(mask);
+        }
+        return -1;
+}
+#endif
+
+/* Make room for len bytes of partial input */
+static int in_reserve(Node *p, int len) {
+        char *in;
+        int cap;
+
+        if (len <= p->in_cap)
+                return 0;
+        for (cap = p->in_cap ? p->in_cap : opts.read_size; cap < len; cap *= 2)
+                ;
+        in = pool_alloc(cap);
+        if (in == NULL)
                 return -1;
+        if (p->in_len)
+                memcpy(in, p->in, p->in_len);
+        pool_free(p->in, p->in_cap);
+        node_account(p, cap - p->in_cap);
+        p->in = in;
+        p->in_cap = cap;
+        return 0;
+}
+
+/* In compact mode, let go of the input buffer once nothing is pending */
+static void in_trim(Node *p) {
+        if (!opts.compact || p->in == NULL || p->in_len)
+                return;
+        pool_free(p->in, p->in_cap);
+        node_account(p, -(long)p->in_cap);
+        p->in = NULL;
+        p->in_cap = 0;
+}
+
+/* Act on one frame from a client. Returns -1 if it makes no sense. */
+int chat_frame(Node *p, int type, char *data, int len) {
+        char name[ROOM_NAME_MAX+1], buf[ROOM_NAME_MAX+24];
+        long since = -1;
+        Msg *m;
+
+        switch (type) {
+        case FRAME_CHAT:
+                if (p->room == NULL)
+                        return 0;
+                m = msg_frame(FRAME_CHAT, data, len);
+                if (m == NULL)
+                        return 0;
+                chat_send(p, m);
+                return 0;
+        case FRAME_JOIN:
+                /* The room's name, then optionally a space and since */
+                if (len == 0 || len >= sizeof(buf) || memchr(data, 0, len))
+                        return -1;
+                memcpy(buf, data, len);
+                buf[len] = '\0';
+                if (strcspn(buf, " ") > ROOM_NAME_MAX
+                    || sscanf(buf, "%32s %ld", name, &since) < 1)
+                        return -1;
+                chat_join(p, name, since);
+                return 0;
+        case FRAME_LEAVE:
+                chat_join(p, NULL, -1);
+                return 0;
+        case FRAME_PONG:
+                return 0;
         }
+        return -1;
+}
 
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_socktype = SOCK_STREAM;
-        if (getaddrinfo(argv[1], argv[2], &hints, &res)) {
-                perror("getaddrinfo");
+/*
+ * Move a client to the named room, or back to the lobby for NULL. A
+ * client that cannot get into the new room falls back to the lobby, and
+ * failing that is in no room at all, and -1 is returned. Returns 1 if
+ * the journal is catching the client up first, as room_join() does.
+ */
+static int room_move(Node *p, const char *name, long since) {
+        Room *r;
+        int ret;
+
+        r = name != NULL ? room_get(name) : room_hold(lobby, 1);
+        if (r == NULL)
                 return -1;
+        if (r == p->room) {
+                room_put(r);
+                return 0;
         }
-        /* Bind socket to a valid socket address */
-        for (ap = res; ap != NULL; ap = ap->ai_next) {
-                family = ap->ai_family;
-                listener = socket(family, ap->ai_socktype, ap->ai_protocol);
-                if (listener >= 0 
-                    && bind(listener, ap->ai_addr, ap->ai_addrlen) >= 0
-                    && listen(listener, 5) >= 0)
-                        break;
-                close(listener);
+        room_leave(p);
+        if ((ret = room_join(p, r, since)) < 0) {
+                room_put(r);
+                return room_lobby(p);
         }
-        freeaddrinfo(res);
-        if (ap == NULL) {
-                logger("unable to bind address");
+        return ret;
+}
+
+/* Put a client in no room into the lobby, or return -1 if it can't be */
+static int room_lobby(Node *p) {
+        if (room_join(p, room_hold(lobby, 1), -1) < 0) {
+                room_put(lobby);
                 return -1;
         }
-        if (family == AF_INET6)
-                logger("IPv6 detected!");
+        return 0;
+}
+
+/*
+ * Move a client to the named room, or back to the lobby for NULL, and
+ * tell it where it ended up. With history on, the room's recent messages
+ * from number since come first, and the reply names the number the next
+ * message will get. A client that cannot get into the new room falls
+ * back to the lobby, and failing that is in no room at all until a later
+ * join works. One the journal is catching up is answered once it has.
+ */
+int chat_join(Node *p, const char *name, long since) {
+        int ret;
+
+        if ((ret = room_move(p, name, since)) != 0)
+                return ret < 0 ? -1 : 0;
+        return chat_joined(p);
+}
+
+/* Tell a client which room it is in now */
+static int chat_joined(Node *p) {
+        char reply[ROOM_NAME_MAX+40];
+
+        if (opts.history)
+                snprintf(reply, sizeof(reply), "joined %s at %lu",
+                         p->room->name, p->room_seq);
         else
-                logger("IPv4 only...");
-        logger("listening on %s %s", argv[1], argv[2]);
+                snprintf(reply, sizeof(reply), "joined %s", p->room->name);
+        return chat_reply(p, reply);
+}
 
-        /* Start thread pool */
-        queue_init();
-        for (i = 0; i < NUM_THREADS; i++) {
-                logger("starting thread %d", i);
-                if (pthread_create(&worker_th, NULL, run, NULL) < 0)
-                        perror("pthread_create");
-                else if (pthread_detach(worker_th) < 0)
-                        perror("pthread_detach");
-                else
-                        continue;
-                close(listener);
+/*
+ * Finish a join once the journal has caught the client up: the rest
+ * comes from the history, unless more went by meanwhile than it holds.
+ * The journal is then asked again, if it had all it was asked for.
+ * Called by the client's runner after worker_fetched() hands it back.
+ */
+void chat_fetched(Node *p) {
+        Room *r = p->fetch_room;
+        int ret;
+
+        p->fetch_room = NULL;
+        ret = room_enter(p, r, p->fetch_upto,
+                         p->fetch_upto == p->fetch_until);
+        if (ret < 0) {
+                room_put(r);
+                ret = room_lobby(p);
+        }
+        if (!ret)
+                chat_joined(p);
+}
+
+/*
+ * Broadcast a client's message to the rest of its room, here and on every
+ * peer node, and drop the caller's reference
+ */
+void chat_send(Node *p, Msg *m) {
+        room_broadcast(p->room, m, p);
+        if (relay.nout)
+                relay_publish(p->room, m);
+        msg_put(m);
+}
+
+/*
+ * Charge a client for len bytes in one more message: move each bucket's
+ * refill time on by what the message costs at the client's rate.
+ */
+static void node_charge(Node *p, int len) {
+        unsigned long now, msgs, bytes;
+
+        /* A reload may change either rate, so read each just once */
+        msgs = __atomic_load_n(&opts.msg_rate, __ATOMIC_RELAXED);
+        bytes = __atomic_load_n(&opts.byte_rate, __ATOMIC_RELAXED);
+        if (!msgs && !bytes)
+                return;
+        now = now_ns();
+        if (msgs) {
+                if (p->msg_due < now)
+                        p->msg_due = now;
+                p->msg_due += 1000000000UL / msgs;
+        }
+        if (bytes) {
+                if (p->byte_due < now)
+                        p->byte_due = now;
+                p->byte_due += len * 1000000000UL / bytes;
+        }
+}
+
+/* If a client is over its rate, when it will be back under, or else 0 */
+static unsigned long node_over(Node *p) {
+        unsigned long due, now;
+
+        if (!opts.msg_rate && !opts.byte_rate)
+                return 0;
+        due = p->msg_due > p->byte_due ? p->msg_due : p->byte_due;
+        now = now_ns();
+        if (due <= now + RATE_BURST * 1000000000UL)
+                return 0;
+        return due - RATE_BURST * 1000000000UL;
+}
+
+/*
+ * Stop reading from a client over its rate until it is back under, so
+ * what it sends backs up in its socket and TCP slows it down, or close
+ * it if that is the policy. Only the client's runner calls this. Returns
+ * -1 if the client should be closed.
+ */
+static int node_park(Node *p, unsigned long until) {
+        Worker *w = p->w;
+        int wake;
+
+        if (p->parked)
+                return 0;
+        metric_add(&metrics_local()->floods, 1);
+        if (opts.flood_kick) {
+                logger("Client over its rate, disconnecting");
                 return -1;
         }
-        /* Accept connections and pass sockets to queue */
-        list_init();
-        while (1) {
-                client = accept(listener, &sa, &len);
-                if (client < 0) {
-                        perror("accept");
-                        break;
+        pthread_mutex_lock(&w->mutex);
+        wake = (w->parked == NULL);
+        p->resume = until;
+        p->park_next = w->parked;
+        w->parked = p;
+        p->parked = 1;
+        pthread_mutex_unlock(&w->mutex);
+        /* The owner may be asleep with no timeout set */
+        if (wake)
+                worker_wake(w);
+        return 0;
+}
+
+/*
+ * Read again from the parked clients whose time is up: queue them to run,
+ * or go on with what they had sent and rearm their io_uring receives.
+ */
+static void worker_unpark(Worker *w) {
+        unsigned long now;
+        Node **pp, *p, *ready = NULL;
+
+        if (__atomic_load_n(&w->parked, __ATOMIC_RELAXED) == NULL)
+                return;
+        now = now_ns();
+        pthread_mutex_lock(&w->mutex);
+        for (pp = &w->parked; (p = *pp) != NULL; ) {
+                if (p->resume > now) {
+                        pp = &p->park_next;
+                        continue;
                 }
-                src = (family == AF_INET6) ? 
-                        (void *)&((struct sockaddr_in6 *)&sa)->sin6_addr :
-                        (void *)&((struct sockaddr_in *)&sa)->sin_addr;
-                if (inet_ntop(family, src, hostname, sizeof(hostname)) != NULL)
-                        logger("new connection from %s!", hostname);
-                if (queue_add(client) < 0)
-                        close(client);
+                *pp = p->park_next;
+                p->park_next = ready;
+                ready = p;
+        }
+        pthread_mutex_unlock(&w->mutex);
+        while ((p = ready) != NULL) {
+                /* Parking it again links it back onto w->parked */
+                ready = p->park_next;
+                p->parked = 0;
+                if (opts.engine == ENGINE_URING)
+                        uring_resume(w, p);
+                else
+                        task_mark(p, EV_READ);
         }
-        close(listener);
-        return 0;
 }
 
-/* Initialize synchronization variables and reset queue pointers */
-void queue_init(void) {
-        pthread_mutex_init(&queue.mutex, NULL);
-        pthread_cond_init(&queue.empty, NULL);
-        queue.read = 0;
-        queue.write = 0;
+/* Link a timer into the slot for its expiry, which is no earlier than now */
+static void wheel_add(Wheel *wh, Timer *t, unsigned long expires) {
+        unsigned long d = expires - wh->now;
+        Timer **slot;
+        int l;
+
+        for (l = 0; l < WHEEL_LEVELS-1 && d >> (WHEEL_BITS * (l+1)); l++)
+                ;
+        /* Past the top level: wait there, and look again when it comes up */
+        if (d >> (WHEEL_BITS * WHEEL_LEVELS))
+                expires = wh->now + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        slot = &wh->slots[l][(expires >> (WHEEL_BITS * l)) & (WHEEL_SLOTS-1)];
+        t->expires = expires;
+        t->next = *slot;
+        if (t->next != NULL)
+                t->next->pprev = &t->next;
+        t->pprev = slot;
+        *slot = t;
+        wh->count++;
 }
 
-/* Get socket from queue */
-int queue_get(void) {
-        int sock;
+/* Unlink a timer, if it is armed */
+static void wheel_del(Wheel *wh, Timer *t) {
+        if (t->pprev == NULL)
+                return;
+        *t->pprev = t->next;
+        if (t->next != NULL)
+                t->next->pprev = t->pprev;
+        t->pprev = NULL;
+        wh->count--;
+}
+
+/*
+ * Run the wheel up to a tick, putting every timer that came due on the
+ * expired list, linked through next and no longer armed.
+ */
+static void wheel_advance(Wheel *wh, unsigned long tick, Timer **expired) {
+        Timer *t, *next;
+        int l, i;
 
-        pthread_mutex_lock(&queue.mutex);
+        while (wh->now < tick) {
+                wh->now++;
+                for (l = 1; l < WHEEL_LEVELS; l++) {
+                        if (wh->now & ((1UL << (WHEEL_BITS * l)) - 1))
+                                break;
+                        i = (wh->now >> (WHEEL_BITS * l)) & (WHEEL_SLOTS-1);
+                        t = wh->slots[l][i];
+                        wh->slots[l][i] = NULL;
+                        for (; t != NULL; t = next) {
+                                next = t->next;
+                                wh->count--;
+                                wheel_add(wh, t, t->expires);
+                        }
+                }
+                i = wh->now & (WHEEL_SLOTS-1);
+                t = wh->slots[0][i];
+                wh->slots[0][i] = NULL;
+                for (; t != NULL; t = next) {
+                        next = t->next;
+                        t->pprev = NULL;
+                        t->next = *expired;
+                        *expired = t;
+                        wh->count--;
+                }
+        }
+}
 
-        /* Wait until we see an item in the queue */
-        while (!queue_size())
-                pthread_cond_wait(&queue.empty, &queue.mutex);
+/* Set a client's timer for due, in ns, unless it has been closed */
+static void node_arm(Node *p, unsigned long due) {
+        Worker *w = p->w;
+        unsigned long tick = due / (WHEEL_TICK_MS * 1000000UL) + 1;
 
-        sock = queue.sockets[queue.read];
-        queue.read = (queue.read+1)%QUEUE_MAX;
-        pthread_mutex_unlock(&queue.mutex);
-        return sock;
+        pthread_mutex_lock(&w->mutex);
+        if (!p->dead) {
+                /* An empty wheel has not been run, so bring it up to date */
+                if (!w->wheel.count)
+                        w->wheel.now = now_ns() / (WHEEL_TICK_MS * 1000000UL);
+                if (tick <= w->wheel.now)
+                        tick = w->wheel.now + 1;
+                wheel_del(&w->wheel, &p->timer);
+                wheel_add(&w->wheel, &p->timer, tick);
+        }
+        pthread_mutex_unlock(&w->mutex);
+}
+
+/*
+ * See to a client whose timer went off. One silent for opts.idle is
+ * pinged, and closed if it is still silent opts.idle later; one with
+ * output that has not moved for opts.stall is closed. Otherwise the
+ * timer is set for whenever one of those could next happen. Only the
+ * owner calls this.
+ */
+static void node_timeout(Node *p, unsigned long now) {
+        unsigned long idle = opts.idle * 1000000000UL;
+        unsigned long stall = opts.stall * 1000000000UL;
+        unsigned long heard, since, due = -1UL;
+        Msg *m;
+        int n;
+
+        if (p->dead)
+                return;
+        if (idle) {
+                heard = __atomic_load_n(&p->heard, __ATOMIC_RELAXED);
+                if (p->ping_at && heard >= p->ping_at)
+                        p->ping_at = 0;
+                if (p->ping_at && now >= p->ping_at + idle) {
+                        logger("Client stopped answering pings, "
+                               "disconnecting");
+                        metric_add(&metrics_local()->idle_kicks, 1);
+                        node_kick(p);
+                        return;
+                }
+                if (p->ping_at) {
+                        due = p->ping_at + idle;
+                } else if (now >= heard + idle) {
+                        if (opts.proto == PROTO_FRAMED) {
+                                m = msg_frame(FRAME_PING, "", 0);
+                                if (m != NULL)
+                                        node_enqueue(p, m);
+                        } else {
+                                chat_reply(p, "/ping");
+                        }
+                        metric_add(&metrics_local()->pings, 1);
+                        p->ping_at = now;
+                        due = now + idle;
+                } else {
+                        due = heard + idle;
+                }
+        }
+        if (stall) {
+                pthread_mutex_lock(&p->mutex);
+                n = out_size(p);
+                since = p->progress;
+                pthread_mutex_unlock(&p->mutex);
+                if (n && now >= since + stall) {
+                        logger("Client stopped reading, disconnecting");
+                        metric_add(&metrics_local()->write_kicks, 1);
+                        node_kick(p);
+                        return;
+                }
+                /* With nothing queued, look again in case there is then */
+                since = n ? since + stall : now + stall;
+                if (since < due)
+                        due = since;
+        }
+        node_arm(p, due);
+}
+
+/*
+ * Close a client from its owner. The io_uring engine only ever runs a
+ * client there, and has to shut one down itself to end a write the peer
+ * will never take. With epoll another worker may be running it, so it is
+ * marked closing for its runner to close, the way the overflow policy
+ * does.
+ */
+static void node_kick(Node *p) {
+        if (opts.engine == ENGINE_URING) {
+                client_close(p);
+                return;
+        }
+        pthread_mutex_lock(&p->mutex);
+        p->closing = 1;
+        node_schedule(p);
+        pthread_mutex_unlock(&p->mutex);
+}
+
+/* Run the timer wheel up to now and see to the clients that came due */
+static void worker_tick(Worker *w) {
+        Timer *t, *expired = NULL;
+        unsigned long now;
+
+        if (!__atomic_load_n(&w->wheel.count, __ATOMIC_RELAXED))
+                return;
+        now = now_ns();
+        pthread_mutex_lock(&w->mutex);
+        wheel_advance(&w->wheel, now / (WHEEL_TICK_MS * 1000000UL), &expired);
+        pthread_mutex_unlock(&w->mutex);
+        while ((t = expired) != NULL) {
+                expired = t->next;
+                node_timeout((Node *)((char *)t - offsetof(Node, timer)), now);
+        }
+}
+
+/*
+ * Send a notice to one client, as a frame or as a line of text. Raw
+ * mode keeps the NUL it has always sent after each message.
+ */
+int chat_reply(Node *p, const char *text) {
+        char line[256];
+        Msg *m;
+        int n;
+
+        if (opts.proto == PROTO_FRAMED) {
+                m = msg_frame(FRAME_NOTICE, (char *)text, strlen(text));
+        } else {
+                n = snprintf(line, sizeof(line), "%s\n", text);
+                m = msg_new(line, opts.proto == PROTO_RAW ? n+1 : n);
+        }
+        if (m == NULL)
+                return -1;
+        return node_enqueue(p, m);
 }
 
-/* Add socket to queue */
-int queue_add(int sock) {
-        pthread_mutex_lock(&queue.mutex);
 
-        /* Return immediately if queue full */
-        if (queue_size() == QUEUE_MAX-1) {
-                pthread_mutex_unlock(&queue.mutex);
+/* Operation tags kept in the low bits of io_uring user data */
+#define OP_ACCEPT 1
+#define OP_WAKE 2
+#define OP_RECV 3
+#define OP_SEND 4
+#define OP_TIMER 5
+#define OP_MASK 63
+
+/* Map a worker's io_uring, register its receive buffers and arm accept */
+int uring_init(Worker *w) {
+        struct io_uring_params params;
+        struct io_uring_buf_reg reg;
+        Ring *r = &w->ring;
+        size_t sq_size, cq_size;
+        char *sq, *cq;
+        unsigned i;
+
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = RING_ENTRIES * 4;
+        r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+        if (r->fd < 0)
                 return -1;
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes
+                + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+                if (cq_size > sq_size)
+                        sq_size = cq_size;
+                cq_size = sq_size;
         }
+        sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED)
+                goto fail;
+        cq = sq;
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+                cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+                if (cq == MAP_FAILED)
+                        goto fail;
+        }
+        r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       r->fd, IORING_OFF_SQES);
+        if (r->sqes == MAP_FAILED)
+                goto fail;
+        r->sq_head = (unsigned *)(sq + params.sq_off.head);
+        r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+        r->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        r->sq_entries = params.sq_entries;
+        r->local_tail = *r->sq_tail;
+        /* Submission slot i always holds sqe i */
+        for (i = 0; i < params.sq_entries; i++)
+                ((unsigned *)(sq + params.sq_off.array))[i] = i;
+        r->cq_head = (unsigned *)(cq + params.cq_off.head);
+        r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+        r->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+        /* Receive buffers the kernel picks from as data arrives */
+        r->br = mmap(NULL, RBUF_COUNT * sizeof(struct io_uring_buf),
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+        r->bufs = malloc(RBUF_COUNT * opts.read_size);
+        if (r->br == MAP_FAILED || r->bufs == NULL)
+                goto fail;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (unsigned long)r->br;
+        reg.ring_entries = RBUF_COUNT;
+        reg.bgid = 0;
+        if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+                    &reg, 1) < 0)
+                goto fail;
+        r->br_tail = 0;
+        for (i = 0; i < RBUF_COUNT; i++)
+                uring_buf_return(r, i);
 
-        /* Add socket to queue and wake up waiters */
-        queue.sockets[queue.write] = sock;
-        queue.write = (queue.write+1)%QUEUE_MAX;
-        pthread_cond_signal(&queue.empty);
-        pthread_mutex_unlock(&queue.mutex);
+        uring_accept(w);
+        uring_poll_wake(w);
         return 0;
+fail:
+        close(r->fd);
+        return -1;
 }
 
-/* Return the number of elements in the queue */
-static int queue_size(void) {
-        return (QUEUE_MAX - queue.read + queue.write)%QUEUE_MAX;
+/* Hand a receive buffer back to the kernel */
+static void uring_buf_return(Ring *r, int bid) {
+        struct io_uring_buf *b;
+
+        b = &r->br->bufs[r->br_tail & (RBUF_COUNT-1)];
+        b->addr = (unsigned long)(r->bufs + bid * opts.read_size);
+        b->len = opts.read_size-1;   /* leave room for chat_input()'s NUL */
+        b->bid = bid;
+        r->br_tail++;
+        __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
 }
 
-/* Initialize synchronization variables and set head to NULL. */
-void list_init(void) {
-        list.head = NULL;
-        pthread_mutex_init(&list.mutex, NULL);
+/* Get a cleared submission entry, submitting the queue if it is full */
+static struct io_uring_sqe *uring_sqe(Ring *r) {
+        struct io_uring_sqe *sqe;
+        unsigned head;
+
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->local_tail - head >= r->sq_entries) {
+                if (uring_enter(r, 0) < 0)
+                        return NULL;
+                head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+                if (r->local_tail - head >= r->sq_entries)
+                        return NULL;
+        }
+        sqe = &r->sqes[r->local_tail & r->sq_mask];
+        r->local_tail++;
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
 }
 
-/* Append an active socket to the socket list. */
-Node *list_append(int sock) {
-        Node *p;
+/* Submit everything queued so far, optionally waiting for a completion */
+static int uring_enter(Ring *r, int wait) {
+        unsigned submit;
+        int ret;
 
-        p = malloc(sizeof(Node));
-        if (p == NULL)
-                return NULL;
-        p->sock = sock;
-        pthread_mutex_lock(&list.mutex);
-        p->next = list.head;
-        list.head = p;
-        pthread_mutex_unlock(&list.mutex);
-        return p;
+        __atomic_store_n(r->sq_tail, r->local_tail, __ATOMIC_RELEASE);
+        submit = r->local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        ret = syscall(__NR_io_uring_enter, r->fd, submit, wait ? 1 : 0,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                log_errno("io_uring_enter");
+                return -1;
+        }
+        return 0;
 }
 
-/* Delete a dead socket from the socket list. */
-void list_delete(int sock) {
-        Node *p, *prev;
+/* Arm a multishot accept on the worker's listener */
+static void uring_accept(Worker *w) {
+        struct io_uring_sqe *sqe;
 
-        pthread_mutex_lock(&list.mutex);
-        for (p = list.head; p != NULL; p = p->next) {
-                if (p->sock == sock)
-                        break;
-                prev = p;
+        sqe = uring_sqe(&w->ring);
+        if (sqe == NULL)
+                return;
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = w->listener;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = OP_ACCEPT;
+}
+
+/* Arm a multishot poll on the wakeup eventfd */
+static void uring_poll_wake(Worker *w) {
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_sqe(&w->ring);
+        if (sqe == NULL)
+                return;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = w->wakefd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = OP_WAKE;
+}
+
+/*
+ * Arm a receive from the worker's buffer ring, multishot unless rated or
+ * journaled
+ */
+static void uring_recv(Worker *w, Node *p) {
+        struct io_uring_sqe *sqe;
+
+        sqe = uring_sqe(&w->ring);
+        if (sqe == NULL) {
+                client_close(p);
+                return;
         }
-        if (p != NULL) {
-                if (p == list.head)
-                        list.head = p->next;
-                else
-                        prev->next = p->next;
-                free(p);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = p->sock;
+        /*
+         * A rate is only checked between receives, and a join may have to
+         * wait on the journal before the next, so then take one at a time.
+         */
+        if (!opts.msg_rate && !opts.byte_rate && !opts.journal)
+                sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = (uintptr_t)p | OP_RECV;
+        p->inflight++;
+        p->receiving = 1;
+}
+
+/*
+ * Read from a client again once nothing holds it back: finish a join the
+ * journal caught it up for, go on with what it sent meanwhile and rearm
+ * its receive, unless it is over its rate or waiting on the journal again
+ */
+static void uring_resume(Worker *w, Node *p) {
+        unsigned long until;
+
+        if (p->fetch_room != NULL && !p->fetching)
+                chat_fetched(p);
+        if (p->in_held && chat_resume(p) < 0) {
+                logger("Client broke the protocol!");
+                client_close(p);
+        } else if (p->fetch_room != NULL) {
+                /* Rearmed once worker_fetched() hands it back */
+        } else if ((until = node_over(p))) {
+                if (node_park(p, until) < 0)
+                        client_close(p);
+        } else if (!p->receiving) {
+                uring_recv(w, p);
         }
-        pthread_mutex_unlock(&list.mutex);
 }
 
-/* Write message to all sockets except last argument. */
-int list_broadcast(char *buf, int len, int except) {
-        Node *p;
+/*
+ * Arm a timeout, so parked clients and the timer wheel are looked at
+ * while idle: PARK_MS if anyone is parked, otherwise a wheel tick.
+ */
+static void uring_timer(Worker *w) {
+        struct io_uring_sqe *sqe;
 
-        pthread_mutex_lock(&list.mutex);
-        for (p = list.head; p != NULL; p = p->next) {
-                if (p->sock == except)
-                        continue;
-                if (write(p->sock, buf, len) != len)
+        if (w->timer || (w->parked == NULL && !w->wheel.count))
+                return;
+        sqe = uring_sqe(&w->ring);
+        if (sqe == NULL)
+                return;
+        w->ring.park.tv_sec = 0;
+        w->ring.park.tv_nsec = (w->parked ? PARK_MS : WHEEL_TICK_MS)
+                * 1000000L;
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uintptr_t)&w->ring.park;
+        sqe->len = 1;
+        sqe->user_data = OP_TIMER;
+        w->timer = 1;
+}
+
+/*
+ * Queue one write of as much of a client's queue as fits an iovec, if
+ * none is outstanding. Writes from every client go to the kernel together
+ * on the next uring_enter(). Returns -1 if the client should be closed.
+ */
+int uring_send(Worker *w, Node *p) {
+        struct io_uring_sqe *sqe;
+        int i, cnt, pos, slots;
+        Msg *m;
+
+        if (p->dead || p->sending)
+                return 0;
+        pthread_mutex_lock(&p->mutex);
+        if (p->closing) {
+                pthread_mutex_unlock(&p->mutex);
+                return -1;
+        }
+        cnt = out_size(p);
+        if (cnt == 0) {
+                pthread_mutex_unlock(&p->mutex);
+                return 0;
+        }
+        if (p->iov == NULL) {
+                p->iov = pool_alloc(FLUSH_IOV * sizeof(struct iovec));
+                if (p->iov == NULL) {
+                        pthread_mutex_unlock(&p->mutex);
                         return -1;
+                }
+                node_account(p, FLUSH_IOV * sizeof(struct iovec));
         }
-        pthread_mutex_unlock(&list.mutex);
+        if (cnt > FLUSH_IOV)
+                cnt = FLUSH_IOV;
+        slots = p->out_cap;
+        for (i = 0, pos = p->out_read; i < cnt; i++) {
+                m = p->out[pos];
+                p->iov[i].iov_base = m->data;
+                p->iov[i].iov_len = m->len;
+                pos = (pos+1)%slots;
+        }
+        p->iov[0].iov_base = (char *)p->iov[0].iov_base + p->out_off;
+        p->iov[0].iov_len -= p->out_off;
+        /* Keep the overflow policy off the messages being written */
+        p->out_busy = cnt;
+        pthread_mutex_unlock(&p->mutex);
+
+        sqe = uring_sqe(&w->ring);
+        if (sqe == NULL)
+                return -1;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = p->sock;
+        sqe->addr = (uintptr_t)p->iov;
+        sqe->len = cnt;
+        sqe->user_data = (uintptr_t)p | OP_SEND;
+        p->sending = 1;
+        p->inflight++;
         return 0;
 }
 
-/* Fetch sockets from queue and process client requests */
-void *run(void *arg) {
-        int client;
+/* Account for a finished write and queue the next one */
+static int uring_sent(Worker *w, Node *p, int res) {
+        int i, cnt, slots;
 
-        while (1) {
-                client = queue_get();
-                list_append(client);
-                chat_loop(client);
-                list_delete(client);
-                close(client);
+        p->sending = 0;
+        if (p->dead)
+                return 0;
+        if (res < 0) {
+                errno = -res;
+                log_errno("writev");
+                return -1;
         }
-        return NULL;
+        metric_add(&metrics_local()->bytes_out, res);
+        pthread_mutex_lock(&p->mutex);
+        if (opts.stall && res > 0)
+                p->progress = now_ns();
+        cnt = p->out_busy;
+        slots = p->out_cap;
+        for (i = 0; i < cnt && res >= p->iov[i].iov_len; i++) {
+                res -= p->iov[i].iov_len;
+                msg_put(p->out[p->out_read]);
+                p->out_off = 0;
+                p->out_read = (p->out_read+1)%slots;
+        }
+        if (i < cnt)
+                p->out_off += res;
+        p->out_busy = 0;
+        out_trim(p);
+        if (opts.compact && p->out == NULL) {
+                pool_free(p->iov, FLUSH_IOV * sizeof(struct iovec));
+                node_account(p, -(long)(FLUSH_IOV * sizeof(struct iovec)));
+                p->iov = NULL;
+        }
+        pthread_mutex_unlock(&p->mutex);
+        return uring_send(w, p);
 }
 
-/* Broadcast every message received to other clients */
-void chat_loop(int client) {
-        char buf[1024];
-        int bytes_read;
+/* Handle one completion */
+static void uring_complete(Worker *w, struct io_uring_cqe *cqe) {
+        Node *p = (Node *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+        int more = cqe->flags & IORING_CQE_F_MORE;
+        int was_dead = (p != NULL && p->dead);
+        struct sockaddr_storage sa;
+        socklen_t len;
+        uint64_t count;
+        unsigned long until;
+        int bid, bad = 0;
 
-        while (1) {
-                bytes_read = read(client, buf, sizeof(buf)-1);
-                if (bytes_read < 0) {
-                        perror("read");
-                        break;
-                } 
-                if (!bytes_read) {
-                        logger("Client closed connection!");
+        switch (cqe->user_data & OP_MASK) {
+        case OP_ACCEPT:
+                if (!more)
+                        uring_accept(w);
+                if (cqe->res < 0) {
+                        if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+                                errno = -cqe->res;
+                                log_errno("accept");
+                        }
                         break;
                 }
-                buf[bytes_read] = '\0';
-                if (list_broadcast(buf, bytes_read+1, client) < 0) {
-                        perror("write");
+                len = sizeof(sa);
+                if (opts.log_level >= LOG_INFO && getpeername(cqe->res,
+                    (struct sockaddr *)&sa, &len) == 0)
+                        log_peer(&sa);
+                if (opts.tls_cert != NULL)
+                        tls_add(cqe->res, w);
+                else
+                        worker_add(w, cqe->res);
+                break;
+        case OP_WAKE:
+                if (!more)
+                        uring_poll_wake(w);
+                if (read(w->wakefd, &count, sizeof(count)) < 0
+                    && errno != EAGAIN)
+                        log_errno("eventfd read");
+                tls_take(w);
+                worker_fetched(w);
+                worker_fanout(w);
+                worker_flush(w);
+                break;
+        case OP_RECV:
+                p->inflight--;
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                        if (cqe->res > 0 && !p->dead)
+                                bad = chat_input(p, w->ring.bufs + bid
+                                                 * opts.read_size,
+                                                 cqe->res) < 0;
+                        uring_buf_return(&w->ring, bid);
+                }
+                if (more)
+                        p->inflight++;
+                else
+                        p->receiving = 0;
+                if (p->dead)
+                        break;
+                /* Over its rate: stop receiving until it is back under */
+                if (!bad && !p->parked && (until = node_over(p))
+                    && node_park(p, until) < 0) {
+                        client_close(p);
                         break;
                 }
+                if (bad) {
+                        logger("Client broke the protocol!");
+                        client_close(p);
+                } else if (cqe->res == 0) {
+                        logger("Client closed connection!");
+                        client_close(p);
+                } else if (p->parked || p->fetch_room != NULL) {
+                        /* Rearmed by worker_unpark() or worker_fetched() */
+                } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                        errno = -cqe->res;
+                        log_errno("read");
+                        client_close(p);
+                } else if (!more) {
+                        /* Out of buffers, or the kernel ended the shot */
+                        uring_recv(w, p);
+                }
+                break;
+        case OP_SEND:
+                p->inflight--;
+                if (uring_sent(w, p, cqe->res) < 0)
+                        client_close(p);
+                break;
+        case OP_TIMER:
+                w->timer = 0;
+                break;
+        }
+        /* The last completion naming a closed client lets it go */
+        if (was_dead && !p->inflight && !p->fetching)
+                ebr_retire(p, node_free);
+}
+
+/* Submit, wait and dispatch completions until something breaks */
+void uring_run(Worker *w) {
+        Ring *r = &w->ring;
+        unsigned head, tail;
+        unsigned long t;
+
+        while (1) {
+                t = now_ns();
+                if (uring_enter(r, 1) < 0)
+                        break;
+                w->idle_ns += now_ns() - t;
+                t = now_ns();
+                ebr_enter();
+                head = *r->cq_head;
+                tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; head++)
+                        uring_complete(w, &r->cqes[head & r->cq_mask]);
+                __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+                worker_unpark(w);
+                worker_tick(w);
+                uring_timer(w);
+                ebr_exit();
+                ebr_reclaim();
+                w->busy_ns += now_ns() - t;
         }
 }